@@ -0,0 +1,88 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "cbor.h"
+
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT     3
+
+char *cbor_put_head(char *p, int major, uint64_t value)
+{
+  unsigned char *u = (unsigned char *)p;
+  int bytes, i;
+  
+  major <<= 5;
+  if(value < 24) {
+    *u = major | value;
+    return p + 1;
+  } else if(value <= 0xff) {
+    *u = major | 24;
+    bytes = 1;
+  } else if(value <= 0xffff) {
+    *u = major | 25;
+    bytes = 2;
+  } else if(value <= 0xffffffff) {
+    *u = major | 26;
+    bytes = 4;
+  } else {
+    *u = major | 27;
+    bytes = 8;
+  }
+  for(i = bytes; i > 0; i--) {
+    u[i] = value & 0xff;
+    value >>= 8;
+  }
+  
+  return p + bytes + 1;
+}
+
+char *cbor_put_text(char *p, const char *s, int len)
+{
+  p = cbor_put_head(p, CBOR_TEXT, len);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+char *cbor_put_int(char *p, int64_t value)
+{
+  if(value < 0) {
+    return cbor_put_head(p, CBOR_NEGATIVE, (uint64_t)(-1 - value));
+  }
+  return cbor_put_head(p, CBOR_UNSIGNED, (uint64_t)value);
+}
+
+char *cbor_put_double(char *p, double value)
+{
+  unsigned char *u = (unsigned char *)p;
+  float narrow = (float)value;
+  uint64_t bits64;
+  uint32_t bits32;
+  int i;
+  
+  if((double)narrow == value) {
+    memcpy(&bits32, &narrow, sizeof(bits32));
+    u[0] = 0xfa;
+    for(i = 4; i > 0; i--) {
+      u[i] = bits32 & 0xff;
+      bits32 >>= 8;
+    }
+    return p + 5;
+  }
+  
+  memcpy(&bits64, &value, sizeof(bits64));
+  u[0] = 0xfb;
+  for(i = 8; i > 0; i--) {
+    u[i] = bits64 & 0xff;
+    bits64 >>= 8;
+  }
+  return p + 9;
+}
+
+char *cbor_put_number(char *p, double value)
+{
+  if(value > -9007199254740992.0 && value < 9007199254740992.0 && value == (double)(int64_t)value) {
+    return cbor_put_int(p, (int64_t)value);
+  }
+  return cbor_put_double(p, value);
+}
@@ -0,0 +1,42 @@
+#ifndef _CBOR_H_
+#define _CBOR_H_
+
+#include <stdint.h>
+
+// Records are framed by a 4 byte big endian length in front of each one,
+// so readers never have to look inside the record to split a stream.
+#define CBOR_FRAME_HEADER 4
+
+// largest cbor_put_number / cbor_put_head output
+#define CBOR_MAX_HEAD 9
+
+// indefinite length map, pairs follow until CBOR_BREAK
+#define CBOR_MAP_BEGIN 0xbf
+#define CBOR_BREAK     0xff
+
+static inline void cbor_frame_set_length(char *frame, uint32_t len)
+{
+  unsigned char *p = (unsigned char *)frame;
+  p[0] = len >> 24;
+  p[1] = len >> 16;
+  p[2] = len >> 8;
+  p[3] = len;
+}
+
+static inline uint32_t cbor_frame_length(const char *frame)
+{
+  const unsigned char *p = (const unsigned char *)frame;
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Each writer stores one item at p and returns the byte after it.
+char *cbor_put_head(char *p, int major, uint64_t value);
+char *cbor_put_text(char *p, const char *s, int len);
+char *cbor_put_int(char *p, int64_t value);
+char *cbor_put_double(char *p, double value);
+
+// integral values as integers, everything else as the narrowest float 
+// that holds it exactly
+char *cbor_put_number(char *p, double value);
+
+#endif /* _CBOR_H_ */
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC    "fmcp"
+#define CHECKPOINT_VERSION  1
+#define CHECKPOINT_LINE     256
+
+volatile sig_atomic_t checkpoint_save_requested = 0;
+volatile sig_atomic_t checkpoint_exit_requested = 0;
+
+static void checkpoint_handler(int sig)
+{
+  if(sig == SIGUSR1) {
+    checkpoint_save_requested = 1;
+  } else {
+    checkpoint_exit_requested = 1;
+  }
+}
+
+static void checkpoint_catch_signals(void)
+{
+  struct sigaction sa;
+  
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = checkpoint_handler;
+  sigemptyset(&sa.sa_mask);
+  // reads and writes carry on, the loops look at the flags between records
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+// FNV-1a over the first len bytes, -1 when the file is shorter
+static int checkpoint_hash(int fd, uint64_t len, uint64_t *hash)
+{
+  unsigned char head[CHECKPOINT_HEAD];
+  uint64_t h = 0xcbf29ce484222325ULL;
+  ssize_t n;
+  uint64_t i;
+  
+  if(len > CHECKPOINT_HEAD) {
+    return -1;
+  }
+  n = pread(fd, head, len, 0);
+  if(n < 0 || (uint64_t)n != len) {
+    return -1;
+  }
+  for(i = 0; i < len; i++) {
+    h ^= head[i];
+    h *= 0x100000001b3ULL;
+  }
+  *hash = h;
+  
+  return 0;
+}
+
+int checkpoint_identify(int fd, checkpoint_id_t *id)
+{
+  struct stat st;
+  
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  id->device = st.st_dev;
+  id->inode = st.st_ino;
+  id->head_length = st.st_size < CHECKPOINT_HEAD ? st.st_size : CHECKPOINT_HEAD;
+  
+  return checkpoint_hash(fd, id->head_length, &id->head_hash);
+}
+
+int checkpoint_same_head(int fd, const checkpoint_id_t *id)
+{
+  uint64_t hash;
+  
+  return checkpoint_hash(fd, id->head_length, &hash) == 0 && hash == id->head_hash;
+}
+
+// Reads the saved checkpoint.  Returns 1 when it is for the input on fd,
+// 0 when there is none or it is for another file, -1 when it is garbled.
+static int checkpoint_load(checkpoint_t *cp, int fd, long long *offset)
+{
+  char line[CHECKPOINT_LINE];
+  char magic[8];
+  unsigned long long device, inode, head_length, head_hash;
+  checkpoint_id_t saved_id;
+  long long saved;
+  int version;
+  FILE *f;
+  
+  f = fopen(cp->filename, "r");
+  if(!f) {
+    return 0;
+  }
+  if(!fgets(line, sizeof(line), f) ||
+     sscanf(line, "%7s %d %llu %llu %llu %llx %lld", magic, &version, &device, &inode,
+            &head_length, &head_hash, &saved) != 7 ||
+     strcmp(magic, CHECKPOINT_MAGIC) != 0 || version != CHECKPOINT_VERSION || saved < 0) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  
+  saved_id.head_length = head_length;
+  saved_id.head_hash = head_hash;
+  if(device != cp->id.device || inode != cp->id.inode || !checkpoint_same_head(fd, &saved_id)) {
+    return 0;
+  }
+  *offset = saved;
+  
+  return 1;
+}
+
+checkpoint_t *checkpoint_open(const char *filename, FILE *infile, int interval,
+                              long long *resume)
+{
+  checkpoint_t *cp = (checkpoint_t *)calloc(1, sizeof(checkpoint_t));
+  int fd = fileno(infile);
+  
+  *resume = 0;
+  if(!cp) {
+    return NULL;
+  }
+  cp->filename = strdup(filename);
+  cp->interval = interval;
+  cp->last_save = time(NULL);
+  if(!cp->filename || checkpoint_identify(fd, &cp->id) != 0 ||
+     checkpoint_load(cp, fd, resume) < 0) {
+    checkpoint_close(cp);
+    return NULL;
+  }
+  cp->offset = *resume;
+  checkpoint_catch_signals();
+  
+  return cp;
+}
+
+int checkpoint_due(checkpoint_t *cp)
+{
+  if(checkpoint_save_requested || checkpoint_exit_requested) {
+    return 1;
+  }
+  return cp->interval > 0 && time(NULL) - cp->last_save >= cp->interval;
+}
+
+int checkpoint_save(checkpoint_t *cp, long long offset)
+{
+  char line[CHECKPOINT_LINE];
+  char *tmp;
+  int fd, len, rc = -1;
+  
+  checkpoint_save_requested = 0;
+  cp->last_save = time(NULL);
+  if(offset == cp->offset) {
+    return 0;
+  }
+  
+  len = snprintf(line, sizeof(line), "%s %d %llu %llu %llu %llx %lld\n", CHECKPOINT_MAGIC,
+                 CHECKPOINT_VERSION, (unsigned long long)cp->id.device,
+                 (unsigned long long)cp->id.inode, (unsigned long long)cp->id.head_length,
+                 (unsigned long long)cp->id.head_hash, offset);
+  tmp = (char *)malloc(strlen(cp->filename) + 5);
+  if(!tmp) {
+    return -1;
+  }
+  sprintf(tmp, "%s.tmp", cp->filename);
+  
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd >= 0) {
+    if(write(fd, line, len) == len && fsync(fd) == 0) {
+      rc = 0;
+    }
+    if(close(fd) != 0) {
+      rc = -1;
+    }
+    if(rc == 0) {
+      rc = rename(tmp, cp->filename);
+    } else {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  if(rc == 0) {
+    cp->offset = offset;
+  }
+  
+  return rc;
+}
+
+void checkpoint_close(checkpoint_t *cp)
+{
+  if(cp) {
+    if(cp->filename) {
+      free(cp->filename);
+    }
+    free(cp);
+  }
+}
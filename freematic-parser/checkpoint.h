@@ -0,0 +1,56 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+// bytes of the input hashed into its identity
+#define CHECKPOINT_HEAD 4096
+
+// Which input a checkpoint belongs to.  Device and inode find the file,
+// the hash of its first head_length bytes catches an inode reused after
+// the log was rotated.  Logs only grow, so a shorter head is rehashed at
+// its saved length.
+typedef struct checkpoint_id_str {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t head_length;
+  uint64_t head_hash;
+} checkpoint_id_t;
+
+// Kept next to the input as one line of text, replaced with a rename so
+// a crash leaves either the old or the new offset.
+typedef struct checkpoint_str {
+  char   *filename;
+  checkpoint_id_t id;
+  int    interval;        // seconds between saves, 0 for on signal only
+  time_t last_save;
+  long long offset;       // last offset saved
+} checkpoint_t;
+
+// Identifies the regular file on fd, -1 when it isn't one.
+int checkpoint_identify(int fd, checkpoint_id_t *id);
+
+// 1 when the file on fd starts with the head id was taken from.
+int checkpoint_same_head(int fd, const checkpoint_id_t *id);
+
+// Set from the handlers checkpoint_open installs, SIGUSR1 asks for a save
+// and SIGINT / SIGTERM for a save and a clean stop.
+extern volatile sig_atomic_t checkpoint_save_requested;
+extern volatile sig_atomic_t checkpoint_exit_requested;
+
+// Opens the checkpoint for infile, a regular file.  *resume is the offset
+// saved for this very input, 0 when there is none or it was saved for
+// another one.  NULL when infile can't be identified or the checkpoint
+// can't be read.
+checkpoint_t *checkpoint_open(const char *filename, FILE *infile, int interval,
+                              long long *resume);
+
+// 1 when the interval has passed or a signal asked for a save
+int checkpoint_due(checkpoint_t *cp);
+int checkpoint_save(checkpoint_t *cp, long long offset);
+void checkpoint_close(checkpoint_t *cp);
+
+#endif /* _CHECKPOINT_H_ */
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define COLUMN_SCAN_X86
+#endif
+
+#include "column_store.h"
+#include "numeric.h"
+
+// count, sum, min and max of the values inside [lo, hi]
+typedef struct scan_result_str {
+  long   count;
+  double sum;
+  double min;
+  double max;
+} scan_result_t;
+
+typedef void (*scan_handler)(const double *values, int count, double lo, double hi,
+                             scan_result_t *r);
+
+static void scan_scalar(const double *values, int count, double lo, double hi,
+                        scan_result_t *r)
+{
+  double v;
+  int i;
+  
+  for(i = 0; i < count; i++) {
+    v = values[i];
+    if(v >= lo && v <= hi) {
+      r->count++;
+      r->sum += v;
+      if(v < r->min) {
+        r->min = v;
+      }
+      if(v > r->max) {
+        r->max = v;
+      }
+    }
+  }
+}
+
+#ifdef COLUMN_SCAN_X86
+
+// Values outside the range are masked to 0 for the sum and to +/-inf for
+// min and max, so the loop has no branches.
+static void scan_sse2(const double *values, int count, double lo, double hi,
+                      scan_result_t *r)
+{
+  const __m128d vlo = _mm_set1_pd(lo);
+  const __m128d vhi = _mm_set1_pd(hi);
+  const __m128d pinf = _mm_set1_pd(INFINITY);
+  const __m128d ninf = _mm_set1_pd(-INFINITY);
+  __m128d v, mask, sum = _mm_setzero_pd(), mn = pinf, mx = ninf;
+  double lanes[2];
+  long n = 0;
+  int i;
+  
+  for(i = 0; i + 2 <= count; i += 2) {
+    v = _mm_loadu_pd(values + i);
+    mask = _mm_and_pd(_mm_cmpge_pd(v, vlo), _mm_cmple_pd(v, vhi));
+    sum = _mm_add_pd(sum, _mm_and_pd(mask, v));
+    mn = _mm_min_pd(mn, _mm_or_pd(_mm_and_pd(mask, v), _mm_andnot_pd(mask, pinf)));
+    mx = _mm_max_pd(mx, _mm_or_pd(_mm_and_pd(mask, v), _mm_andnot_pd(mask, ninf)));
+    n += __builtin_popcount(_mm_movemask_pd(mask));
+  }
+  
+  _mm_storeu_pd(lanes, sum);
+  r->sum += lanes[0] + lanes[1];
+  _mm_storeu_pd(lanes, mn);
+  r->min = fmin(r->min, fmin(lanes[0], lanes[1]));
+  _mm_storeu_pd(lanes, mx);
+  r->max = fmax(r->max, fmax(lanes[0], lanes[1]));
+  r->count += n;
+  
+  scan_scalar(values + i, count - i, lo, hi, r);
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const double *values, int count, double lo, double hi,
+                      scan_result_t *r)
+{
+  const __m256d vlo = _mm256_set1_pd(lo);
+  const __m256d vhi = _mm256_set1_pd(hi);
+  const __m256d pinf = _mm256_set1_pd(INFINITY);
+  const __m256d ninf = _mm256_set1_pd(-INFINITY);
+  __m256d v, mask, sum = _mm256_setzero_pd(), mn = pinf, mx = ninf;
+  double lanes[4];
+  long n = 0;
+  int i;
+  
+  for(i = 0; i + 4 <= count; i += 4) {
+    v = _mm256_loadu_pd(values + i);
+    mask = _mm256_and_pd(_mm256_cmp_pd(v, vlo, _CMP_GE_OQ), _mm256_cmp_pd(v, vhi, _CMP_LE_OQ));
+    sum = _mm256_add_pd(sum, _mm256_and_pd(mask, v));
+    mn = _mm256_min_pd(mn, _mm256_blendv_pd(pinf, v, mask));
+    mx = _mm256_max_pd(mx, _mm256_blendv_pd(ninf, v, mask));
+    n += __builtin_popcount(_mm256_movemask_pd(mask));
+  }
+  
+  _mm256_storeu_pd(lanes, sum);
+  r->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd(lanes, mn);
+  r->min = fmin(r->min, fmin(fmin(lanes[0], lanes[1]), fmin(lanes[2], lanes[3])));
+  _mm256_storeu_pd(lanes, mx);
+  r->max = fmax(r->max, fmax(fmax(lanes[0], lanes[1]), fmax(lanes[2], lanes[3])));
+  r->count += n;
+  
+  scan_scalar(values + i, count - i, lo, hi, r);
+}
+
+static scan_handler scan_impl = scan_sse2;
+
+void scan_init(void)
+{
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    scan_impl = scan_avx2;
+  }
+}
+
+#else
+
+static scan_handler scan_impl = scan_scalar;
+
+void scan_init(void)
+{
+}
+
+#endif /* COLUMN_SCAN_X86 */
+
+void print_number(char *label, double value)
+{
+  char buffer[NUMERIC_LENGTH + 1];
+  int len = numeric_format(value, buffer, NUMERIC_LENGTH);
+  
+  buffer[len < 0 ? 0 : len] = 0;
+  printf("%s%s", label, buffer);
+}
+
+void usage(char *command_line)
+{
+  printf("freematics column store scanner\n");
+  printf("Usage: %s <options> <column file>, where options are:\n", command_line);
+  printf("  -c <column> -- column to scan, lists the columns when not given\n");
+  printf("  -r <lo>:<hi> -- only values in this range (default: all)\n");
+  printf("  -p -- print the matching samples as time_delta,value\n");
+  exit(-1);
+}
+
+struct config_str {
+  char    *input_file;
+  char    *column;
+  double  lo;
+  double  hi;
+  int     print;
+};
+
+struct config_str *config_base(void)
+{
+  struct config_str *config = (struct config_str *)calloc(1, sizeof(struct config_str));
+  if(config) {
+    config->input_file = NULL;
+    config->column = NULL;
+    config->lo = -INFINITY;
+    config->hi = INFINITY;
+    config->print = 0;
+  }
+  return config;
+}
+
+void config_free(struct config_str *config)
+{
+  if(config) {
+    if(config->input_file) {
+      free(config->input_file);
+    }
+    if(config->column) {
+      free(config->column);
+    }
+    free(config);
+  }
+}
+
+struct config_str *parse_command_line(int argc, char **argv)
+{
+  char *options = "c:r:p?";
+  char *sep;
+  int c;
+  
+  struct config_str *config = config_base();
+  if(config) {
+    while((c = getopt(argc, argv, options)) != -1) {
+      switch(c) {
+        case 'c':
+          config->column = strdup(optarg);
+          break;
+        case 'r':
+          sep = strchr(optarg, ':');
+          if(!sep || numeric_parse(optarg, sep - optarg, &config->lo) != 0 ||
+             numeric_parse(sep + 1, strlen(sep + 1), &config->hi) != 0) {
+            goto bugout;
+          }
+          break;
+        case 'p':
+          config->print = 1;
+          break;
+        case '?':
+          goto bugout;
+      }
+    }
+    if(optind < argc) {
+      config->input_file = strdup(argv[optind]);
+    } else {
+      goto bugout;
+    }
+  }
+  
+  if(0) {
+bugout:
+    if(config) {
+      config_free(config);
+      config = NULL;
+    }
+    usage(argv[0]);
+  }
+  
+  return config;
+}
+
+void list_columns(column_reader_t *reader)
+{
+  column_block_t *block;
+  long *rows;
+  uint32_t i;
+  
+  rows = (long *)calloc(reader->trailer->column_count, sizeof(long));
+  for(i = 0; i < reader->trailer->block_count; i++) {
+    block = &reader->blocks[i];
+    if(block->column < reader->trailer->column_count) {
+      rows[block->column] += block->count;
+    }
+  }
+  for(i = 0; i < reader->trailer->column_count; i++) {
+    printf("%s: %ld samples\n", column_reader_name(reader, i), rows[i]);
+  }
+  free(rows);
+}
+
+// Blocks whose range lies outside [lo, hi] are skipped and those inside
+// it are answered from the footer, only the rest are decoded.
+int scan_column(column_reader_t *reader, int column, struct config_str *config,
+                scan_result_t *r)
+{
+  int64_t *times = (int64_t *)malloc(COLUMN_BLOCK_ROWS * sizeof(int64_t));
+  double *values = (double *)malloc(COLUMN_BLOCK_ROWS * sizeof(double));
+  column_block_t *block;
+  uint32_t i;
+  int n, j, rc = 0;
+  
+  if(!times || !values) {
+    free(times);
+    free(values);
+    return -1;
+  }
+  
+  for(i = 0; i < reader->trailer->block_count; i++) {
+    block = &reader->blocks[i];
+    if(block->column != (uint32_t)column) {
+      continue;
+    }
+    if(block->value_max < config->lo || block->value_min > config->hi) {
+      continue;
+    }
+    if(!config->print && block->value_min >= config->lo && block->value_max <= config->hi) {
+      r->count += block->count;
+      r->sum += block->value_sum;
+      r->min = fmin(r->min, block->value_min);
+      r->max = fmax(r->max, block->value_max);
+      continue;
+    }
+  
+    n = column_reader_decode(reader, block, times, values);
+    if(n < 0) {
+      fprintf(stderr, "Damaged block at offset %lu\n", (unsigned long)block->offset);
+      rc = -1;
+      continue;
+    }
+    if(config->print) {
+      for(j = 0; j < n; j++) {
+        if(values[j] >= config->lo && values[j] <= config->hi) {
+          printf("%lld", (long long)times[j]);
+          print_number(",", values[j]);
+          printf("\n");
+        }
+      }
+    }
+    (*scan_impl)(values, n, config->lo, config->hi, r);
+  }
+  
+  free(times);
+  free(values);
+  return rc;
+}
+
+int main(int argc, char **argv)
+{
+  scan_result_t result;
+  int column, rc = 0;
+  
+  struct config_str *config = parse_command_line(argc, argv);
+  if(config == NULL) {
+    usage(argv[0]);
+  }
+  scan_init();
+  
+  column_reader_t *reader = column_reader_open(config->input_file);
+  if(reader == NULL) {
+    fprintf(stderr, "Unable to open column file: %s\n", config->input_file);
+    exit(-1);
+  }
+  
+  if(config->column == NULL) {
+    list_columns(reader);
+  } else {
+    column = column_reader_find(reader, config->column);
+    if(column < 0) {
+      fprintf(stderr, "No column named %s\n", config->column);
+      rc = -1;
+    } else {
+      memset(&result, 0, sizeof(result));
+      result.min = INFINITY;
+      result.max = -INFINITY;
+      rc = scan_column(reader, column, config, &result);
+      if(!config->print) {
+        printf("%s: count %ld", config->column, result.count);
+        if(result.count > 0) {
+          print_number(", min ", result.min);
+          print_number(", max ", result.max);
+          print_number(", sum ", result.sum);
+          print_number(", mean ", result.sum / result.count);
+        }
+        printf("\n");
+      }
+    }
+  }
+  
+  column_reader_close(reader);
+  config_free(config);
+  return rc == 0 ? 0 : 1;
+}
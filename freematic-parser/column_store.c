@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "column_store.h"
+#include "gorilla.h"
+
+#define COLUMN_HEADER_LENGTH 8
+#define COLUMN_OUTPUT_LENGTH (1024 * 1024)
+// worst case block for either codec, for delta a varint per time and value 
+// plus the value encoding flag
+#define COLUMN_ENCODED_LENGTH (COLUMN_BLOCK_ROWS * 20 + 16)
+#define COLUMN_MAX_INT 9007199254740992.0
+
+static inline uint64_t zigzag(int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline char *put_varint(char *p, uint64_t v)
+{
+  while(v >= 0x80) {
+    *p++ = (char)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (char)v;
+  return p;
+}
+
+static inline const char *get_varint(const char *p, const char *end, uint64_t *v)
+{
+  uint64_t r = 0;
+  int shift = 0;
+  
+  while(p < end && shift < 64) {
+    r |= (uint64_t)(*p & 0x7f) << shift;
+    if(!(*p++ & 0x80)) {
+      *v = r;
+      return p;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+static uint32_t column_hash(const char *name)
+{
+  uint32_t h = 2166136261u;
+  
+  while(*name) {
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  }
+  return h;
+}
+
+// Times and integral values as zigzag varint deltas, other values raw.
+static int column_encode(column_t *column, char *buffer)
+{
+  char *p = buffer;
+  int i, integral = 1;
+  double v;
+  
+  p = put_varint(p, zigzag(column->times[0]));
+  for(i = 1; i < column->count; i++) {
+    p = put_varint(p, zigzag(column->times[i] - column->times[i - 1]));
+  }
+  
+  for(i = 0; i < column->count && integral; i++) {
+    v = column->values[i];
+    integral = v > -COLUMN_MAX_INT && v < COLUMN_MAX_INT && v == (double)(int64_t)v;
+  }
+  *p++ = (char)integral;
+  if(integral) {
+    p = put_varint(p, zigzag((int64_t)column->values[0]));
+    for(i = 1; i < column->count; i++) {
+      p = put_varint(p, zigzag((int64_t)column->values[i] - (int64_t)column->values[i - 1]));
+    }
+  } else {
+    memcpy(p, column->values, column->count * sizeof(double));
+    p += column->count * sizeof(double);
+  }
+  
+  return p - buffer;
+}
+
+static int column_decode(const char *p, const char *end, int count, int64_t *times, double *values)
+{
+  uint64_t v;
+  int64_t last;
+  int i, integral;
+  
+  for(i = 0; i < count; i++) {
+    if(!(p = get_varint(p, end, &v))) {
+      return -1;
+    }
+    times[i] = i == 0 ? unzigzag(v) : times[i - 1] + unzigzag(v);
+  }
+  
+  if(p >= end) {
+    return -1;
+  }
+  integral = *p++;
+  if(integral) {
+    last = 0;
+    for(i = 0; i < count; i++) {
+      if(!(p = get_varint(p, end, &v))) {
+        return -1;
+      }
+      last = i == 0 ? unzigzag(v) : last + unzigzag(v);
+      values[i] = (double)last;
+    }
+  } else {
+    if(end - p < (long)(count * sizeof(double))) {
+      return -1;
+    }
+    memcpy(values, p, count * sizeof(double));
+  }
+  
+  return count;
+}
+
+static int column_flush_block(column_writer_t *w, int idx)
+{
+  column_t *column = &w->columns[idx];
+  column_block_t *block;
+  char *buffer;
+  int i, len;
+  
+  if(column->count == 0) {
+    return 0;
+  }
+  if(w->block_count == w->block_capacity) {
+    int capacity = w->block_capacity ? w->block_capacity * 2 : 64;
+    column_block_t *blocks = (column_block_t *)realloc(w->blocks, capacity * sizeof(column_block_t));
+    if(!blocks) {
+      return -1;
+    }
+    w->blocks = blocks;
+    w->block_capacity = capacity;
+  }
+  
+  block = &w->blocks[w->block_count++];
+  memset(block, 0, sizeof(column_block_t));
+  block->column = idx;
+  block->codec = w->codec;
+  block->count = column->count;
+  block->offset = w->offset;
+  block->time_min = block->time_max = column->times[0];
+  block->value_min = block->value_max = column->values[0];
+  for(i = 0; i < column->count; i++) {
+    if(column->times[i] < block->time_min) {
+      block->time_min = column->times[i];
+    }
+    if(column->times[i] > block->time_max) {
+      block->time_max = column->times[i];
+    }
+    if(column->values[i] < block->value_min) {
+      block->value_min = column->values[i];
+    }
+    if(column->values[i] > block->value_max) {
+      block->value_max = column->values[i];
+    }
+    block->value_sum += column->values[i];
+  }
+  
+  buffer = output_buffer_reserve(w->out, COLUMN_ENCODED_LENGTH);
+  if(!buffer) {
+    return -1;
+  }
+  if(w->codec == COLUMN_CODEC_GORILLA) {
+    len = gorilla_encode(column->times, column->values, column->count, buffer);
+  } else {
+    len = column_encode(column, buffer);
+  }
+  output_buffer_commit(w->out, len);
+  block->length = len;
+  w->offset += len;
+  column->count = 0;
+  
+  return 0;
+}
+
+int column_codec_from_string(const char *name)
+{
+  if(strcmp(name, "delta") == 0) {
+    return COLUMN_CODEC_DELTA;
+  } else if(strcmp(name, "gorilla") == 0) {
+    return COLUMN_CODEC_GORILLA;
+  }
+  return -1;
+}
+
+column_writer_t *column_writer_create(int fd, column_codec_t codec)
+{
+  column_writer_t *w = (column_writer_t *)calloc(1, sizeof(column_writer_t));
+  char header[COLUMN_HEADER_LENGTH];
+  uint32_t version = COLUMN_VERSION;
+  int i;
+  
+  if(!w) {
+    return NULL;
+  }
+  w->out = output_buffer_create(COLUMN_OUTPUT_LENGTH, fd);
+  w->codec = codec;
+  w->hash_size = 256;
+  w->hash = (int *)malloc(w->hash_size * sizeof(int));
+  if(!w->out || !w->hash) {
+    output_buffer_destroy(w->out);
+    free(w->hash);
+    free(w);
+    return NULL;
+  }
+  for(i = 0; i < w->hash_size; i++) {
+    w->hash[i] = -1;
+  }
+  
+  memcpy(header, COLUMN_MAGIC, 4);
+  memcpy(header + 4, &version, 4);
+  output_buffer_append(w->out, header, COLUMN_HEADER_LENGTH);
+  w->offset = COLUMN_HEADER_LENGTH;
+  
+  return w;
+}
+
+static int column_writer_rehash(column_writer_t *w)
+{
+  int size = w->hash_size * 2;
+  int *hash = (int *)malloc(size * sizeof(int));
+  int i, slot;
+  
+  if(!hash) {
+    return -1;
+  }
+  for(i = 0; i < size; i++) {
+    hash[i] = -1;
+  }
+  for(i = 0; i < w->column_count; i++) {
+    slot = column_hash(w->columns[i].name) & (size - 1);
+    while(hash[slot] >= 0) {
+      slot = (slot + 1) & (size - 1);
+    }
+    hash[slot] = i;
+  }
+  free(w->hash);
+  w->hash = hash;
+  w->hash_size = size;
+  
+  return 0;
+}
+
+int column_writer_column(column_writer_t *w, const char *name)
+{
+  column_t *column;
+  int slot;
+  
+  if(!w || !name || strlen(name) >= COLUMN_NAME_LENGTH) {
+    return -1;
+  }
+  
+  slot = column_hash(name) & (w->hash_size - 1);
+  while(w->hash[slot] >= 0) {
+    if(strcmp(w->columns[w->hash[slot]].name, name) == 0) {
+      return w->hash[slot];
+    }
+    slot = (slot + 1) & (w->hash_size - 1);
+  }
+  
+  if(w->column_count == w->column_capacity) {
+    int capacity = w->column_capacity ? w->column_capacity * 2 : 32;
+    column_t *columns = (column_t *)realloc(w->columns, capacity * sizeof(column_t));
+    if(!columns) {
+      return -1;
+    }
+    w->columns = columns;
+    w->column_capacity = capacity;
+  }
+  column = &w->columns[w->column_count];
+  memset(column, 0, sizeof(column_t));
+  strcpy(column->name, name);
+  column->times = (int64_t *)malloc(COLUMN_BLOCK_ROWS * sizeof(int64_t));
+  column->values = (double *)malloc(COLUMN_BLOCK_ROWS * sizeof(double));
+  if(!column->times || !column->values) {
+    free(column->times);
+    free(column->values);
+    return -1;
+  }
+  w->hash[slot] = w->column_count++;
+  
+  // keep the table at most half full
+  if(w->column_count * 2 > w->hash_size) {
+    column_writer_rehash(w);
+  }
+  
+  return w->column_count - 1;
+}
+
+int column_writer_append(column_writer_t *w, int column, int64_t time_delta, double value)
+{
+  column_t *c;
+  
+  if(!w || column < 0 || column >= w->column_count) {
+    return -1;
+  }
+  c = &w->columns[column];
+  c->times[c->count] = time_delta;
+  c->values[c->count] = value;
+  c->count++;
+  if(c->count == COLUMN_BLOCK_ROWS) {
+    return column_flush_block(w, column);
+  }
+  return 0;
+}
+
+int column_writer_close(column_writer_t *w)
+{
+  column_trailer_t trailer;
+  char padding[8];
+  int i, rc = 0;
+  
+  if(!w) {
+    return -1;
+  }
+  
+  for(i = 0; i < w->column_count && rc == 0; i++) {
+    rc = column_flush_block(w, i);
+  }
+  
+  if(rc == 0) {
+    // the footer is read in place from a mapping, keep it aligned
+    memset(padding, 0, sizeof(padding));
+    if(w->offset & 7) {
+      output_buffer_append(w->out, padding, 8 - (w->offset & 7));
+      w->offset += 8 - (w->offset & 7);
+    }
+  
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.footer_offset = w->offset;
+    trailer.column_count = w->column_count;
+    trailer.block_count = w->block_count;
+    memcpy(trailer.magic, COLUMN_MAGIC, 4);
+    trailer.version = COLUMN_VERSION;
+    for(i = 0; i < w->column_count && rc == 0; i++) {
+      rc = output_buffer_append(w->out, w->columns[i].name, COLUMN_NAME_LENGTH);
+    }
+    if(rc == 0 && w->block_count) {
+      rc = output_buffer_append(w->out, (char *)w->blocks, w->block_count * sizeof(column_block_t));
+    }
+    if(rc == 0) {
+      rc = output_buffer_append(w->out, (char *)&trailer, sizeof(trailer));
+    }
+    if(rc == 0) {
+      rc = output_buffer_flush(w->out);
+    }
+  }
+  
+  for(i = 0; i < w->column_count; i++) {
+    free(w->columns[i].times);
+    free(w->columns[i].values);
+  }
+  free(w->columns);
+  free(w->blocks);
+  free(w->hash);
+  output_buffer_destroy(w->out);
+  free(w);
+  
+  return rc;
+}
+
+column_reader_t *column_reader_open(const char *filename)
+{
+  column_reader_t *r;
+  struct stat st;
+  uint64_t footer_length;
+  int fd;
+  
+  fd = open(filename, O_RDONLY);
+  if(fd < 0) {
+    return NULL;
+  }
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t)(COLUMN_HEADER_LENGTH + sizeof(column_trailer_t))) {
+    close(fd);
+    return NULL;
+  }
+  
+  r = (column_reader_t *)calloc(1, sizeof(column_reader_t));
+  if(!r) {
+    close(fd);
+    return NULL;
+  }
+  r->length = st.st_size;
+  r->data = mmap(NULL, r->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(r->data == MAP_FAILED) {
+    free(r);
+    return NULL;
+  }
+  
+  r->trailer = (column_trailer_t *)(r->data + r->length - sizeof(column_trailer_t));
+  footer_length = (uint64_t)r->trailer->column_count * COLUMN_NAME_LENGTH +
+                  (uint64_t)r->trailer->block_count * sizeof(column_block_t);
+  if(memcmp(r->data, COLUMN_MAGIC, 4) != 0 || memcmp(r->trailer->magic, COLUMN_MAGIC, 4) != 0 ||
+     r->trailer->version != COLUMN_VERSION || (r->trailer->footer_offset & 7) ||
+     r->trailer->footer_offset + footer_length + sizeof(column_trailer_t) != r->length) {
+    column_reader_close(r);
+    return NULL;
+  }
+  r->names = r->data + r->trailer->footer_offset;
+  r->blocks = (column_block_t *)(r->names + r->trailer->column_count * COLUMN_NAME_LENGTH);
+  
+  return r;
+}
+
+void column_reader_close(column_reader_t *r)
+{
+  if(r) {
+    munmap(r->data, r->length);
+    free(r);
+  }
+}
+
+int column_reader_find(column_reader_t *r, const char *name)
+{
+  uint32_t i;
+  
+  for(i = 0; i < r->trailer->column_count; i++) {
+    if(strncmp(r->names + i * COLUMN_NAME_LENGTH, name, COLUMN_NAME_LENGTH) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *column_reader_name(column_reader_t *r, int column)
+{
+  if(column < 0 || (uint32_t)column >= r->trailer->column_count) {
+    return NULL;
+  }
+  return r->names + column * COLUMN_NAME_LENGTH;
+}
+
+int column_reader_decode(column_reader_t *r, column_block_t *block, int64_t *times,
+                         double *values)
+{
+  const char *start;
+  
+  if(block->count == 0 || block->count > COLUMN_BLOCK_ROWS ||
+     block->offset + block->length > r->trailer->footer_offset) {
+    return -1;
+  }
+  start = r->data + block->offset;
+  
+  switch(block->codec) {
+    case COLUMN_CODEC_DELTA:
+      return column_decode(start, start + block->length, block->count, times, values);
+    case COLUMN_CODEC_GORILLA:
+      return gorilla_decode(start, block->length, block->count, times, values);
+  }
+  return -1;
+}
@@ -0,0 +1,100 @@
+#ifndef _COLUMN_STORE_H_
+#define _COLUMN_STORE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "output_buffer.h"
+
+// File layout, all in host byte order:
+//   header   magic and version
+//   blocks   encoded (time_delta, value) runs of one column each
+//   footer   column names, then one column_block_t per block
+//   trailer  where the footer starts and how big it is
+#define COLUMN_MAGIC        "FMCS"
+#define COLUMN_VERSION      1
+#define COLUMN_BLOCK_ROWS   4096
+#define COLUMN_NAME_LENGTH  48
+
+typedef enum {
+  COLUMN_CODEC_DELTA = 0,  // zigzag varint deltas, values as ints when integral
+  COLUMN_CODEC_GORILLA     // delta of delta times and xor'ed values, see gorilla.h
+} column_codec_t;
+
+// Footer entry per block.  The ranges and sum let a scan skip blocks, or
+// answer for them, without decoding.
+typedef struct column_block_str {
+  uint32_t column;
+  uint32_t codec;
+  uint32_t count;
+  uint32_t length;
+  uint64_t offset;
+  int64_t  time_min;
+  int64_t  time_max;
+  double   value_min;
+  double   value_max;
+  double   value_sum;
+} column_block_t;
+
+typedef struct column_trailer_str {
+  uint64_t footer_offset;
+  uint32_t column_count;
+  uint32_t block_count;
+  char     magic[4];
+  uint32_t version;
+} column_trailer_t;
+
+typedef struct column_str {
+  char    name[COLUMN_NAME_LENGTH];
+  int64_t *times;
+  double  *values;
+  int     count;
+} column_t;
+
+typedef struct column_writer_str {
+  output_buffer_t *out;
+  uint64_t offset;
+  column_codec_t codec;
+
+  column_t *columns;
+  int      column_count;
+  int      column_capacity;
+  int      *hash;         // open addressing over names, -1 when free
+  int      hash_size;
+
+  column_block_t *blocks;
+  int      block_count;
+  int      block_capacity;
+} column_writer_t;
+
+typedef struct column_reader_str {
+  char   *data;
+  size_t length;
+  column_trailer_t *trailer;
+  char   *names;
+  column_block_t *blocks;
+} column_reader_t;
+
+// Writes the store to fd as it goes, nothing needs to seek.
+column_writer_t *column_writer_create(int fd, column_codec_t codec);
+int column_codec_from_string(const char *name);
+
+// Index of the named column, created on first use.  Callers keep it to
+// skip the lookup on every sample.
+int column_writer_column(column_writer_t *w, const char *name);
+int column_writer_append(column_writer_t *w, int column, int64_t time_delta, double value);
+
+// flushes the partial blocks and writes the footer
+int column_writer_close(column_writer_t *w);
+
+column_reader_t *column_reader_open(const char *filename);
+void column_reader_close(column_reader_t *r);
+int column_reader_find(column_reader_t *r, const char *name);
+const char *column_reader_name(column_reader_t *r, int column);
+
+// Decodes a block into times and values, both COLUMN_BLOCK_ROWS long.
+// Returns the row count, -1 for a damaged block.
+int column_reader_decode(column_reader_t *r, column_block_t *block, int64_t *times,
+                         double *values);
+
+#endif /* _COLUMN_STORE_H_ */
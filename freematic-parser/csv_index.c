@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "data_stream.h"
+#include "time_index.h"
+
+#define BUFFER_LENGTH 2048
+#define RMC_FIELDS    11
+
+void usage(char *command_line)
+{
+  printf("freematics time index builder\n");
+  printf("Usage: %s <options> <input file>, where options are:\n", command_line);
+  printf("  -n <lines> -- index every this many lines (default: %d)\n", TIME_INDEX_EVERY);
+  printf("  -o <file> -- index file (default: <input file>.idx)\n");
+  printf("  csv_to_json -x reads the index\n");
+  exit(-1);
+}
+
+struct config_str {
+  char    *input_file;
+  char    *index_file;
+  int     every;
+};
+
+struct config_str *config_base(void)
+{
+  struct config_str *config = (struct config_str *)calloc(1, sizeof(struct config_str));
+  if(config) {
+    config->input_file = NULL;
+    config->index_file = NULL;
+    config->every = TIME_INDEX_EVERY;
+  }
+  return config;
+}
+
+void config_free(struct config_str *config)
+{
+  if(config) {
+    if(config->input_file) {
+      free(config->input_file);
+    }
+    if(config->index_file) {
+      free(config->index_file);
+    }
+    free(config);
+  }
+}
+
+struct config_str *parse_command_line(int argc, char **argv)
+{
+  char *options = "n:o:?";
+  int c;
+  
+  struct config_str *config = config_base();
+  if(config) {
+    while((c = getopt(argc, argv, options)) != -1) {
+      switch(c) {
+        case 'n':
+          config->every = atoi(optarg);
+          if(config->every <= 0) {
+            goto bugout;
+          }
+          break;
+        case 'o':
+          config->index_file = strdup(optarg);
+          break;
+        case '?':
+          goto bugout;
+      }
+    }
+    if(optind < argc) {
+      config->input_file = strdup(argv[optind]);
+    } else {
+      goto bugout;
+    }
+    if(!config->index_file) {
+      config->index_file = (char *)malloc(strlen(config->input_file) + 5);
+      sprintf(config->index_file, "%s.idx", config->input_file);
+    }
+  }
+  
+  if(0) {
+bugout:
+    if(config) {
+      config_free(config);
+      config = NULL;
+    }
+    usage(argv[0]);
+  }
+  
+  return config;
+}
+
+int two_digits(char *p)
+{
+  if(p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') {
+    return -1;
+  }
+  return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+// The gps clock of an RMC sentence with a valid fix,
+//   time_delta,$GPRMC,hhmmss[.sss],A,lat,N,lon,W,speed,track,ddmmyy,...
+// Returns -1 for any other line.
+int rmc_utc(char *line, char *end, int64_t *utc_ms)
+{
+  char *fields[RMC_FIELDS];
+  int lengths[RMC_FIELDS];
+  char *p = line, *comma;
+  int i, hh, mm, ss, ms = 0, day, month, year;
+  
+  for(i = 0; i < RMC_FIELDS; i++) {
+    comma = memchr(p, ',', end - p);
+    fields[i] = p;
+    lengths[i] = (comma ? comma : end) - p;
+    if(!comma) {
+      if(i < RMC_FIELDS - 1) {
+        return -1;
+      }
+      break;
+    }
+    p = comma + 1;
+  }
+  
+  if(lengths[1] != 6 || fields[1][0] != '$' || fields[1][1] != 'G' ||
+     memcmp(fields[1] + 3, "RMC", 3) != 0 || lengths[3] != 1 || fields[3][0] != 'A' ||
+     lengths[2] < 6 || lengths[10] != 6) {
+    return -1;
+  }
+  hh = two_digits(fields[2]);
+  mm = two_digits(fields[2] + 2);
+  ss = two_digits(fields[2] + 4);
+  day = two_digits(fields[10]);
+  month = two_digits(fields[10] + 2);
+  year = two_digits(fields[10] + 4);
+  if(hh < 0 || mm < 0 || ss < 0 || day < 1 || month < 1 || month > 12 || year < 0) {
+    return -1;
+  }
+  // fractional seconds, to the millisecond
+  if(lengths[2] > 7 && fields[2][6] == '.') {
+    for(i = 7; i < 10; i++) {
+      ms = ms * 10 + (i < lengths[2] && fields[2][i] >= '0' && fields[2][i] <= '9' ? fields[2][i] - '0' : 0);
+    }
+  }
+  *utc_ms = time_index_utc_ms(2000 + year, month, day, hh, mm, ss, ms);
+  
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  time_index_writer_t *w;
+  ds_source_state_t *src;
+  long long time_delta, offset;
+  int64_t utc_ms;
+  char *line, *end, *next;
+  int n, rc = 0;
+  
+  struct config_str *config = parse_command_line(argc, argv);
+  if(config == NULL) {
+    usage(argv[0]);
+  }
+  
+  src = ds_open_file(config->input_file, BUFFER_LENGTH);
+  if(src == NULL) {
+    fprintf(stderr, "Unable to open input: %s\n", config->input_file);
+    exit(-1);
+  }
+  w = time_index_writer_create(config->every);
+  if(w == NULL) {
+    fprintf(stderr, "Unable to allocate the index\n");
+    exit(-1);
+  }
+  
+  while((n = ds_peek_line(src, &line, &end, &next)) > 0) {
+    offset = ds_tell(src);
+    if(ds_line_time(line, end, &time_delta) == 0) {
+      if(time_index_writer_line(w, time_delta, offset) != 0 ||
+         (rmc_utc(line, end, &utc_ms) == 0 &&
+          time_index_writer_anchor(w, utc_ms, time_delta, offset) != 0)) {
+        fprintf(stderr, "Unable to allocate the index\n");
+        rc = -1;
+        break;
+      }
+    }
+    src->current = next;
+  }
+  if(n < 0) {
+    fprintf(stderr, "Error reading input\n");
+    rc = -1;
+  }
+  
+  if(rc == 0) {
+    if(time_index_writer_save(w, config->index_file, fileno(src->infile), ds_tell(src)) != 0) {
+      fprintf(stderr, "Unable to write index: %s\n", config->index_file);
+      rc = -1;
+    } else {
+      printf("%s: %d entries, %d gps anchors%s\n", config->index_file, w->entry_count,
+             w->anchor_count, w->monotonic ? "" : ", time_delta restarts in the log");
+    }
+  }
+  
+  time_index_writer_destroy(w);
+  ds_close_file(src);
+  config_free(config);
+  return rc == 0 ? 0 : 1;
+}
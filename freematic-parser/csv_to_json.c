@@ -2,11 +2,29 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <limits.h>
 
 #include "data_stream.h"
+#include "line_scan.h"
+#include "output_buffer.h"
+#include "numeric.h"
+#include "obd_pid.h"
+#include "cbor.h"
+#include "column_store.h"
+#include "checkpoint.h"
+#include "time_index.h"
 
 #define BUFFER_LENGTH 2048
 #define COMMA_BATCH   16
+#define LINE_SCAN_SPAN (1 << 20)
+#define PARALLEL_CHUNK (4 * 1024 * 1024)
+#define MAX_THREADS    256
+#define OUTPUT_LENGTH  (1024 * 1024)
+#define GPS_MAX_FIELDS 32
+#define CHECKPOINT_STANZAS 1024
 
 typedef struct stanza_str {
   char *head;
@@ -14,6 +32,7 @@ typedef struct stanza_str {
   int  *commas;
   int  comma_idx;
   int  max_commas;
+  unsigned char xor_sum;  // xor of every byte in the line
 } stanza_t;
 
 void delete_stanza(stanza_t *s)
@@ -26,11 +45,39 @@ void delete_stanza(stanza_t *s)
   }
 }
 
+// field idx of the stanza and its length, fields are split at the commas
+char *stanza_field(stanza_t *stanza, int idx, int *len)
+{
+  int start = idx == 0 ? 0 : stanza->commas[idx - 1] + 1;
+  int end = idx < stanza->comma_idx ? stanza->commas[idx] : stanza->length;
+  *len = end - start;
+  return stanza->head + start;
+}
+
+char *copy_out(char *dest, char *src, int len)
+{
+  memcpy(dest, src, len);
+  return dest + len;
+}
+
+#define COPY_LITERAL(dest, s) copy_out(dest, s, sizeof(s) - 1)
+#define CBOR_LITERAL(dest, s) cbor_put_text(dest, s, sizeof(s) - 1)
+
+// a csv field as a cbor number when it is one, as text otherwise
+char *cbor_put_field(char *p, char *field, int len)
+{
+  double value;
+  
+  if(numeric_parse(field, len, &value) == 0) {
+    return cbor_put_number(p, value);
+  }
+  return cbor_put_text(p, field, len);
+}
+
 int read_stanza(ds_source_state_t *src, stanza_t *stanza)
 {
   unsigned long available;
-  int n, idx;
-  char c;
+  int n, idx, found, span;
   
   if(!src || !stanza) {
     return -1;
@@ -46,6 +93,7 @@ int read_stanza(ds_source_state_t *src, stanza_t *stanza)
   stanza->head = src->current;
   stanza->comma_idx = 0;
   stanza->length = 0;
+  stanza->xor_sum = 0;
   idx = 0;
   while(1) {
     if((available < src->max_buffer / 8) && !src->eof) {
@@ -54,34 +102,37 @@ int read_stanza(ds_source_state_t *src, stanza_t *stanza)
         return -1;
       }
       stanza->head = src->current;
-      available = src->length - idx;
-    } else if((available == 0) && src->eof) {
+      available = src->length - (src->current - src->buffer) - idx;
+    }
+    if((available == 0) && src->eof) {
+      // unterminated last line
+      src->current = src->current + idx;
       break;
     }
     
-    c = *(src->current + idx);
-    available--;
-    if(c == '\r' || c == '\n') {
+    // the scanner needs a block worth of free comma slots
+    while(stanza->max_commas - stanza->comma_idx < LINE_SCAN_BLOCK) {
+      int *ptr = (int *)realloc(stanza->commas, (stanza->max_commas + COMMA_BATCH) * sizeof(int));
+      memset(ptr + stanza->max_commas, 0, sizeof(int) * COMMA_BATCH);
+      stanza->commas = ptr;
+      stanza->max_commas += COMMA_BATCH;
+    }
+    
+    // a mapped file can have far more than a line buffered
+    span = available > LINE_SCAN_SPAN ? LINE_SCAN_SPAN : available;
+    n = line_scan(src->current + idx, span, idx, stanza->commas, &stanza->comma_idx,
+                  stanza->max_commas, &found, &stanza->xor_sum);
+    idx += n;
+    available -= n;
+    if(found) {
       *(src->current + idx) = 0;
       src->current = src->current + idx + 1;
-      if(available) {
-        while(isspace(*(src->current)) && available) {
-          available--;
-          src->current++;
-        }
+      available--;
+      while(available && isspace(*(src->current))) {
+        available--;
+        src->current++;
       }
       break;
-    } else {
-      if(c == ',') {
-        if(stanza->comma_idx == stanza->max_commas) {
-          int *ptr = (int *)realloc(stanza->commas, (stanza->max_commas + COMMA_BATCH) * sizeof(int));
-          memset(ptr + stanza->max_commas, 0, sizeof(int) * COMMA_BATCH);
-          stanza->commas = ptr;
-          stanza->max_commas += COMMA_BATCH;
-        }
-        stanza->commas[stanza->comma_idx++] = idx;
-      }
-      idx++;
     }
   }  
 
@@ -89,17 +140,71 @@ int read_stanza(ds_source_state_t *src, stanza_t *stanza)
   return idx;
 }
 
+// A template field rendered ahead of time.  key holds ', "name": ' and 
+// the leading separator is skipped for the first field written.  Fields 
+// that take a value wrap it in prefix / suffix (quotes, the checksum '*'), 
+// constant fields such as the type are rendered entirely into key.
+typedef struct gps_segment_str {
+  char *key;
+  int  key_len;
+  char *prefix;
+  int  prefix_len;
+  char *suffix;
+  int  suffix_len;
+  int  is_value;
+  int  decode;
+  char *cbor_key;         // key, and the value for literal segments
+  int  cbor_key_len;
+  int  column;            // column store index, -1 until first used
+} gps_segment_t;
+
+// How a field is rendered with -n, text fields are always copied as is.
+typedef enum {
+  GPS_TEXT = 0,
+  GPS_NUMBER,       // native number, "08" becomes 8
+  GPS_LATITUDE,     // ddmm.mmmm to signed decimal degrees
+  GPS_LONGITUDE,    // dddmm.mmmm to signed decimal degrees
+  GPS_HEMISPHERE    // folded into the sign of the coordinate before it
+} gps_decode_t;
+
+int numeric_output = 0;
+
+typedef enum {
+  OUTPUT_JSON = 0,
+  OUTPUT_CBOR,      // length framed cbor maps, see cbor.h
+  OUTPUT_COLUMNS    // numeric fields per column, see column_store.h
+} output_format_t;
+
+int output_format = OUTPUT_JSON;
+column_writer_t *column_output = NULL;
+
+// -a, time_delta window that pid samples are summarised over, 0 for off
+long aggregate_window = 0;
+
+// -b, pid samples within this much of the last one written are dropped.
+// A threshold ending in % is relative to that last value.
+int    deadband = 0;
+double deadband_absolute = 0;
+double deadband_relative = 0;
+// -k, a pid is written at least this often in time_delta, 0 for never
+long   deadband_keyframe = 10000;
+
 typedef struct gps_type_template_str {
   char *type;
   char **fields;
   char **format;
-  int  expected_commas;
-  int  template_len;
+  gps_decode_t *decode;
+  int  min_commas;        // sentences with optional trailing fields
+  int  expected_commas;   // commas with every field present
+  int  template_len;      // everything but the values, braces included
+  int  cbor_len;          // the same for cbor, frame header included
+  gps_segment_t *segments;
+  int  segment_count;
 } gps_type_template_t;
 
 char *gga_fields[] = { 
   "time_delta", "type", "time", "latitude", "latitude_ns",
-  "longitude", "latitude_ns", "fix_quality", "satellites", 
+  "longitude", "longitude_ew", "fix_quality", "satellites", 
   "horizontal_dilution", "altitude", "altitude_units", "geoid_height",
   "geoid_height_units", "delta_last_dgps", "dgps_station_id", "checksum", NULL
 };
@@ -109,19 +214,32 @@ char *gga_field_format[] = {
   "%s", "%s", "\"%s\"", "%s", "\"%s\"", "%s", "%s", "\"*%s\"", NULL
 };
 
+gps_decode_t gga_decode[] = {
+  GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_LATITUDE, GPS_HEMISPHERE,
+  GPS_LONGITUDE, GPS_HEMISPHERE, GPS_NUMBER, GPS_NUMBER,
+  GPS_NUMBER, GPS_NUMBER, GPS_TEXT, GPS_NUMBER,
+  GPS_TEXT, GPS_NUMBER, GPS_TEXT, GPS_TEXT
+};
+
 char *rmc_fields[] = {
   "time_delta", "type", "time", "status", "latitude", "latitude_ns",
   "longitude", "longitude_ew", "speed", "track_angle", "date",
-  "magnetic_variation", "magnetic_variation_dir", "mode", "checksum",
-  NULL
+  "magnetic_variation", "magnetic_variation_dir", "mode", "nav_status",
+  "checksum", NULL
 };
 
 char *rmc_field_format[] = {
   "%s", "rmc", "%s", "\"%s\"", "%s", "\"%s\"", "%s", "\"%s\"",
-  "%s", "%s", "%s", "%s", "\"%s\"", "\"%s\"", "\"%s\"",
+  "%s", "%s", "%s", "%s", "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
   NULL
 };
 
+gps_decode_t rmc_decode[] = {
+  GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_LATITUDE, GPS_HEMISPHERE,
+  GPS_LONGITUDE, GPS_HEMISPHERE, GPS_NUMBER, GPS_NUMBER, GPS_TEXT,
+  GPS_NUMBER, GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT
+};
+
 char *vtg_fields[] = {
   "time_delta", "type", "true_track",  "true_track_fixed", 
   "magnetic_track", "magnetic_track_fixed",
@@ -137,46 +255,265 @@ char *vtg_field_format[] = {
   NULL
 };
 
+gps_decode_t vtg_decode[] = {
+  GPS_TEXT, GPS_TEXT, GPS_NUMBER, GPS_TEXT, GPS_NUMBER, GPS_TEXT,
+  GPS_NUMBER, GPS_TEXT, GPS_NUMBER, GPS_TEXT, GPS_TEXT, GPS_TEXT
+};
+
+// satellite ids, elevations and the like carry leading zeros, so they are
+// quoted to keep the json valid
+char *gsa_fields[] = {
+  "time_delta", "type", "mode", "fix_type",
+  "prn_1", "prn_2", "prn_3", "prn_4", "prn_5", "prn_6",
+  "prn_7", "prn_8", "prn_9", "prn_10", "prn_11", "prn_12",
+  "pdop", "hdop", "vdop", "system_id", "checksum",
+  NULL
+};
+
+char *gsa_field_format[] = {
+  "%s", "gsa", "\"%s\"", "%s",
+  "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
+  "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
+  "%s", "%s", "%s", "\"%s\"", "\"%s\"",
+  NULL
+};
+
+gps_decode_t gsa_decode[] = {
+  GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_NUMBER,
+  GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT,
+  GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT,
+  GPS_NUMBER, GPS_NUMBER, GPS_NUMBER, GPS_TEXT, GPS_TEXT
+};
+
+// up to four satellites per sentence, the last one of a group has fewer
+char *gsv_fields[] = {
+  "time_delta", "type", "messages", "message_number", "satellites_in_view",
+  "prn_1", "elevation_1", "azimuth_1", "snr_1",
+  "prn_2", "elevation_2", "azimuth_2", "snr_2",
+  "prn_3", "elevation_3", "azimuth_3", "snr_3",
+  "prn_4", "elevation_4", "azimuth_4", "snr_4",
+  "checksum",
+  NULL
+};
+
+char *gsv_field_format[] = {
+  "%s", "gsv", "%s", "%s", "%s",
+  "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
+  "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
+  "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
+  "\"%s\"", "\"%s\"", "\"%s\"", "\"%s\"",
+  "\"%s\"",
+  NULL
+};
+
+char *gll_fields[] = {
+  "time_delta", "type", "latitude", "latitude_ns", "longitude", "longitude_ew",
+  "time", "status", "mode", "checksum",
+  NULL
+};
+
+char *gll_field_format[] = {
+  "%s", "gll", "%s", "\"%s\"", "%s", "\"%s\"", "%s", "\"%s\"", "\"%s\"", "\"%s\"",
+  NULL
+};
+
+gps_decode_t gll_decode[] = {
+  GPS_TEXT, GPS_TEXT, GPS_LATITUDE, GPS_HEMISPHERE, GPS_LONGITUDE, GPS_HEMISPHERE,
+  GPS_TEXT, GPS_TEXT, GPS_TEXT, GPS_TEXT
+};
+
+char *zda_fields[] = {
+  "time_delta", "type", "time", "day", "month", "year",
+  "zone_hours", "zone_minutes", "checksum",
+  NULL
+};
+
+char *zda_field_format[] = {
+  "%s", "zda", "%s", "\"%s\"", "\"%s\"", "%s", "\"%s\"", "\"%s\"", "\"%s\"",
+  NULL
+};
+
+typedef enum {
+  GPS_GGA = 0,
+  GPS_RMC,
+  GPS_VTG,
+  GPS_GSA,
+  GPS_GSV,
+  GPS_GLL,
+  GPS_ZDA,
+  GPS_TEMPLATE_COUNT
+} gps_template_idx_t;
+
+#define NMEA_KEY(a, b, c) (((a) << 16) | ((b) << 8) | (c))
+
+// sentence type to template, the three letters packed into one switch key
+int gps_template_index(char *type)
+{
+  switch(NMEA_KEY(toupper(type[0]), toupper(type[1]), toupper(type[2]))) {
+    case NMEA_KEY('G', 'G', 'A'):
+      return GPS_GGA;
+    case NMEA_KEY('R', 'M', 'C'):
+      return GPS_RMC;
+    case NMEA_KEY('V', 'T', 'G'):
+      return GPS_VTG;
+    case NMEA_KEY('G', 'S', 'A'):
+      return GPS_GSA;
+    case NMEA_KEY('G', 'S', 'V'):
+      return GPS_GSV;
+    case NMEA_KEY('G', 'L', 'L'):
+      return GPS_GLL;
+    case NMEA_KEY('Z', 'D', 'A'):
+      return GPS_ZDA;
+  }
+  return -1;
+}
+
+
+char *copy_literal(char *s, int len)
+{
+  char *r = (char *)calloc(len + 1, sizeof(char));
+  if(r) {
+    memcpy(r, s, len);
+  }
+  return r;
+}
+
+// Split every field format around its %s once at startup so rendering a 
+// sentence is nothing but memcpy.
+int compile_gps_template(gps_type_template_t *template)
+{
+  char buffer[256];
+  char *value, *end;
+  int i, count = 0;
+  gps_segment_t *seg;
+  
+  while(template->fields[count] != NULL) {
+    count++;
+  }
+  template->segments = (gps_segment_t *)calloc(count, sizeof(gps_segment_t));
+  if(!template->segments) {
+    return -1;
+  }
+  template->segment_count = count;
+  
+  // "{ " and " }"
+  template->template_len = 4;
+  // frame header, map start and break
+  template->cbor_len = CBOR_FRAME_HEADER + 2;
+  for(i = 0; i < count; i++) {
+    seg = &template->segments[i];
+    value = strstr(template->format[i], "%s");
+    if(value) {
+      snprintf(buffer, sizeof(buffer), ", \"%s\": ", template->fields[i]);
+      seg->is_value = 1;
+      seg->decode = template->decode ? template->decode[i] : GPS_TEXT;
+      seg->prefix_len = value - template->format[i];
+      seg->prefix = copy_literal(template->format[i], seg->prefix_len);
+      seg->suffix_len = strlen(value + 2);
+      seg->suffix = copy_literal(value + 2, seg->suffix_len);
+    } else {
+      snprintf(buffer, sizeof(buffer), ", \"%s\": \"%s\"", template->fields[i], template->format[i]);
+    }
+    seg->column = -1;
+    seg->key_len = strlen(buffer);
+    seg->key = copy_literal(buffer, seg->key_len);
+    template->template_len += seg->key_len + seg->prefix_len + seg->suffix_len;
+    
+    end = cbor_put_text(buffer, template->fields[i], strlen(template->fields[i]));
+    if(!seg->is_value) {
+      end = cbor_put_text(end, template->format[i], strlen(template->format[i]));
+    }
+    seg->cbor_key_len = end - buffer;
+    seg->cbor_key = copy_literal(buffer, seg->cbor_key_len);
+    template->cbor_len += seg->cbor_key_len;
+  }
+  
+  return 0;
+}
 
 gps_type_template_t *gps_templates = NULL;
 gps_type_template_t *generate_gps_templates()
 {
-  gps_type_template_t *templates = (gps_type_template_t *)calloc(5, sizeof(gps_type_template_t));
-  templates[0].type = "gga";
-  templates[0].fields = gga_fields;
-  templates[0].format = gga_field_format;
-  templates[0].expected_commas = 15;
-  templates[0].template_len = -1;
-  templates[1].type = "rmc";
-  templates[1].fields = rmc_fields;
-  templates[1].format = rmc_field_format;
-  templates[1].expected_commas = 13;
-  templates[1].template_len = -1;
-  templates[2].type = "vtg";
-  templates[2].fields = vtg_fields;
-  templates[2].format = vtg_field_format;
-  templates[2].expected_commas = 10;
-  templates[2].template_len = -1;
-  templates[3].type = NULL;
+  int i;
+  gps_type_template_t *templates = (gps_type_template_t *)calloc(GPS_TEMPLATE_COUNT + 1, sizeof(gps_type_template_t));
+  templates[GPS_GGA].type = "gga";
+  templates[GPS_GGA].fields = gga_fields;
+  templates[GPS_GGA].format = gga_field_format;
+  templates[GPS_GGA].decode = gga_decode;
+  templates[GPS_GGA].min_commas = 15;
+  templates[GPS_GGA].expected_commas = 15;
+  templates[GPS_RMC].type = "rmc";
+  templates[GPS_RMC].fields = rmc_fields;
+  templates[GPS_RMC].format = rmc_field_format;
+  templates[GPS_RMC].decode = rmc_decode;
+  templates[GPS_RMC].min_commas = 12;
+  templates[GPS_RMC].expected_commas = 14;
+  templates[GPS_VTG].type = "vtg";
+  templates[GPS_VTG].fields = vtg_fields;
+  templates[GPS_VTG].format = vtg_field_format;
+  templates[GPS_VTG].decode = vtg_decode;
+  templates[GPS_VTG].min_commas = 10;
+  templates[GPS_VTG].expected_commas = 10;
+  templates[GPS_GSA].type = "gsa";
+  templates[GPS_GSA].fields = gsa_fields;
+  templates[GPS_GSA].format = gsa_field_format;
+  templates[GPS_GSA].decode = gsa_decode;
+  templates[GPS_GSA].min_commas = 18;
+  templates[GPS_GSA].expected_commas = 19;
+  templates[GPS_GSV].type = "gsv";
+  templates[GPS_GSV].fields = gsv_fields;
+  templates[GPS_GSV].format = gsv_field_format;
+  templates[GPS_GSV].min_commas = 4;
+  templates[GPS_GSV].expected_commas = 20;
+  templates[GPS_GLL].type = "gll";
+  templates[GPS_GLL].fields = gll_fields;
+  templates[GPS_GLL].format = gll_field_format;
+  templates[GPS_GLL].decode = gll_decode;
+  templates[GPS_GLL].min_commas = 7;
+  templates[GPS_GLL].expected_commas = 8;
+  templates[GPS_ZDA].type = "zda";
+  templates[GPS_ZDA].fields = zda_fields;
+  templates[GPS_ZDA].format = zda_field_format;
+  templates[GPS_ZDA].min_commas = 7;
+  templates[GPS_ZDA].expected_commas = 7;
+  templates[GPS_TEMPLATE_COUNT].type = NULL;
+  
+  for(i = 0; templates[i].type != NULL; i++) {
+    compile_gps_template(&templates[i]);
+  }
   return templates;
 }
  
-int parse_gps_fields(stanza_t *stanza, int field_cnt, char **fields)
+// Split the sentence into fields.  Sentences may stop short of the full 
+// template, the fields they lack stay empty and the checksum always lands 
+// in the last slot (field_cnt + 1).
+int parse_gps_fields(stanza_t *stanza, int min_cnt, int field_cnt, char **fields, int *lengths)
 {
   int r = -1, idx;
   
   if(stanza && fields && (field_cnt > 0)) {
-    if(stanza->comma_idx == field_cnt) {
+    if(stanza->comma_idx >= min_cnt && stanza->comma_idx <= field_cnt && stanza->length >= 3) {
       if(stanza->head[stanza->length - 3] == '*') {
         // parse main fields
         fields[0] = stanza->head;
+        lengths[0] = stanza->commas[0];
         for(idx = 0; idx < stanza->comma_idx; idx++)  {
           stanza->head[stanza->commas[idx]] = 0;
           fields[idx + 1] = stanza->head + stanza->commas[idx] + 1;
+          if(idx + 1 < stanza->comma_idx) {
+            lengths[idx + 1] = stanza->commas[idx + 1] - stanza->commas[idx] - 1;
+          } else {
+            lengths[idx + 1] = stanza->length - 3 - stanza->commas[idx] - 1;
+          }
+        }
+        for(idx = stanza->comma_idx + 1; idx <= field_cnt; idx++) {
+          fields[idx] = NULL;
+          lengths[idx] = 0;
         }
   
         // parse checksum
-        fields[idx + 1] = stanza->head + stanza->length - 2;
+        fields[field_cnt + 1] = stanza->head + stanza->length - 2;
+        lengths[field_cnt + 1] = 2;
         *(stanza->head + stanza->length - 3) = 0;
       
         r = 0;
@@ -187,213 +524,1850 @@ int parse_gps_fields(stanza_t *stanza, int field_cnt, char **fields)
   return r;
 }
 
-int populate_gps_template(char **template_fields, char **template_field_format, char **fields, 
-                          int field_cnt, char *buffer, int buffer_len)
+// Value of a field for -n.  Returns 1 with *value set, 0 when the field 
+// is left out and -1 when it stays text.
+int decode_gps_field(gps_segment_t *seg, char **fields, int *lengths, int field_idx,
+                     int *coordinate, double *value)
+{
+  double degrees;
+  char hemisphere;
+  
+  switch(seg->decode) {
+    case GPS_NUMBER:
+      if(numeric_parse(fields[field_idx], lengths[field_idx], value) == 0) {
+        return 1;
+      }
+      break;
+    case GPS_LATITUDE:
+    case GPS_LONGITUDE:
+      if(numeric_parse(fields[field_idx], lengths[field_idx], value) == 0) {
+        degrees = (int)(*value / 100);
+        *value = degrees + (*value - degrees * 100) / 60;
+        hemisphere = lengths[field_idx + 1] > 0 ? fields[field_idx + 1][0] : 0;
+        if(hemisphere == 'S' || hemisphere == 'W') {
+          *value = -*value;
+        }
+        *coordinate = 1;
+        return 1;
+      }
+      break;
+    case GPS_HEMISPHERE:
+      if(*coordinate) {
+        *coordinate = 0;
+        return 0;
+      }
+      break;
+  }
+  
+  return -1;
+}
+
+// render fields into buffer, returns the length written or -1 if it won't fit
+// Renders the segments from first on, the fields before it are skipped.
+int populate_gps_template(gps_type_template_t *template, int first, char **fields, 
+                          int *lengths, char *buffer, int buffer_len)
 {
-  int result = -1;
-  int buffer_idx = 0, field_idx = 0;
-  int tidx, fidx;
-  int field_len, value_len, need_comma;
+  char number[NUMERIC_LENGTH];
+  char *value;
+  double decoded;
+  int buffer_idx, field_idx = 0;
+  int tidx, skip, value_len, coordinate = 0;
+  gps_segment_t *seg;
 
-  tidx = 0;
+  for(tidx = 0; tidx < first; tidx++) {
+    field_idx += template->segments[tidx].is_value;
+  }
   memcpy(buffer, "{ ", 2);
   buffer_idx = 2;
-  need_comma = 0;
-  while(template_fields[tidx] != NULL) {
-    if(strnstr(template_field_format[tidx], "%s", strlen(template_field_format[tidx]))) {
-      if(fields[field_idx] && strlen(fields[field_idx]) > 0) {
-        if(buffer_idx + strlen(template_field_format[tidx]) + 
-                        strlen(template_fields[tidx]) + strlen(fields[field_idx]) +
-                        6 > buffer_len) {
-          return -1;
+  skip = 2;
+  for(tidx = first; tidx < template->segment_count; tidx++) {
+    seg = &template->segments[tidx];
+    if(seg->is_value) {
+      if(lengths[field_idx] > 0) {
+        value = fields[field_idx];
+        value_len = lengths[field_idx];
+        if(numeric_output && seg->decode != GPS_TEXT) {
+          switch(decode_gps_field(seg, fields, lengths, field_idx, &coordinate, &decoded)) {
+            case 1:
+              value = number;
+              value_len = numeric_format(decoded, number, NUMERIC_LENGTH);
+              break;
+            case 0:
+              value_len = 0;
+              break;
+          }
         }
-        if(need_comma) {
-          snprintf(buffer + buffer_idx, buffer_len - buffer_idx, ", \"%s\": ", template_fields[tidx]);
-        } else {
-          snprintf(buffer + buffer_idx, buffer_len - buffer_idx, "\"%s\": ", template_fields[tidx]);
+        if(value_len == 0) {
+          field_idx++;
+          continue;
+        }
+        if(buffer_idx + seg->key_len + seg->prefix_len + value_len +
+           seg->suffix_len + 3 > buffer_len) {
+          return -1;
         }
-        buffer_idx += strlen(buffer + buffer_idx);
-        snprintf(buffer + buffer_idx, buffer_len - buffer_idx, template_field_format[tidx], fields[field_idx]);
-        buffer_idx += strlen(buffer + buffer_idx);
-        need_comma = 1;
+        memcpy(buffer + buffer_idx, seg->key + skip, seg->key_len - skip);
+        buffer_idx += seg->key_len - skip;
+        memcpy(buffer + buffer_idx, seg->prefix, seg->prefix_len);
+        buffer_idx += seg->prefix_len;
+        memcpy(buffer + buffer_idx, value, value_len);
+        buffer_idx += value_len;
+        memcpy(buffer + buffer_idx, seg->suffix, seg->suffix_len);
+        buffer_idx += seg->suffix_len;
+        skip = 0;
       }
       field_idx++;
     } else {
-      if(buffer_idx + strlen(template_field_format[tidx]) + 
-                      strlen(template_fields[tidx]) + 6 > buffer_len) {
+      if(buffer_idx + seg->key_len + 3 > buffer_len) {
         return -1;
       }
-      if(need_comma) {
-        snprintf(buffer + buffer_idx, buffer_len - buffer_idx, ", \"%s\": \"%s\"", template_fields[tidx], template_field_format[tidx]);
-      } else {
-        snprintf(buffer + buffer_idx, buffer_len - buffer_idx, "\"%s\": \"%s\"", template_fields[tidx], template_field_format[tidx]);
-      }      
-      buffer_idx += strlen(buffer + buffer_idx);
-      need_comma = 1;
+      memcpy(buffer + buffer_idx, seg->key + skip, seg->key_len - skip);
+      buffer_idx += seg->key_len - skip;
+      skip = 0;
     }
-    tidx++;
-  }
-  if(buffer_idx + 3 > buffer_len) {
-    return -1;
   }
-  snprintf(buffer + buffer_idx, 3, " }");
+  memcpy(buffer + buffer_idx, " }", 3);
   buffer_idx += 2;
-  *(buffer + buffer_idx) = 0;
   
-  return 0;
+  return buffer_idx;
 }
 
-char *parse_gps_stanza(stanza_t *stanza, int template_idx)
+// The time_delta and fields the template decodes as numbers go out as
+// cbor numbers when they parse as such, the rest as text so times and
+// dates keep their leading zeros.  Returns the framed length.
+int populate_gps_cbor(gps_type_template_t *template, char **fields, int *lengths,
+                      char *buffer, int buffer_len)
 {
-  char *result = NULL;
-  int len;
-  char **fields;
-  char **template_fields;
-  char **template_field_format;
-  int field_cnt;
-  
-  if(template_idx >= 0) {
-    template_fields = gps_templates[template_idx].fields;
-    template_field_format = gps_templates[template_idx].format;
-    field_cnt = gps_templates[template_idx].expected_commas;
-    
-    if(gps_templates[template_idx].template_len == -1) {
-      // need to initialize length
-      int i = 0;
-      int tlen = 0;
-      while(template_fields[i] != NULL) {
-        // field name + quotes + colon + space + value quotes + comma + json needed
-        tlen += strlen(template_fields[i]) + 2 + 2 + 2 + 1;
-        i++;
+  char *p = buffer + CBOR_FRAME_HEADER;
+  char *end = buffer + buffer_len;
+  double value;
+  int field_idx = 0;
+  int tidx, kind, coordinate = 0;
+  gps_segment_t *seg;
+  
+  *p++ = (char)CBOR_MAP_BEGIN;
+  for(tidx = 0; tidx < template->segment_count; tidx++) {
+    seg = &template->segments[tidx];
+    if(seg->is_value) {
+      if(lengths[field_idx] > 0) {
+        if(numeric_output && seg->decode != GPS_TEXT) {
+          kind = decode_gps_field(seg, fields, lengths, field_idx, &coordinate, &value);
+        } else if((tidx == 0 || (seg->decode != GPS_TEXT && seg->decode != GPS_HEMISPHERE)) &&
+                  numeric_parse(fields[field_idx], lengths[field_idx], &value) == 0) {
+          kind = 1;
+        } else {
+          kind = -1;
+        }
+        if(kind != 0) {
+          if(p + seg->cbor_key_len + CBOR_MAX_HEAD + lengths[field_idx] + 1 > end) {
+            return -1;
+          }
+          p = copy_out(p, seg->cbor_key, seg->cbor_key_len);
+          if(kind > 0) {
+            p = cbor_put_number(p, value);
+          } else {
+            p = cbor_put_text(p, fields[field_idx], lengths[field_idx]);
+          }
+        }
       }
-      gps_templates[template_idx].template_len = tlen + 32;
+      field_idx++;
+    } else {
+      if(p + seg->cbor_key_len + 1 > end) {
+        return -1;
+      }
+      p = copy_out(p, seg->cbor_key, seg->cbor_key_len);
     }
-    
-    fields = (char **)calloc(field_cnt + 4, sizeof(char *));
-    if(fields) {
-      if(parse_gps_fields(stanza, field_cnt, fields) == 0) {
-        len = stanza->length + gps_templates[template_idx].template_len + field_cnt * 2;
-        fields[1] = fields[0];
-        result = calloc(len, sizeof(char));
-        if(populate_gps_template(template_fields, template_field_format, fields + 1, field_cnt + 1, result, len) != 0) {
-          free(result);
-          result = NULL;
-        }
+  }
+  *p++ = (char)CBOR_BREAK;
+  cbor_frame_set_length(buffer, p - buffer - CBOR_FRAME_HEADER);
+  
+  return p - buffer;
+}
+
+// Every field with a numeric decoding becomes a "<type>.<field>" column, 
+// coordinates in decimal degrees.  Returns the samples appended.
+int populate_gps_columns(gps_type_template_t *template, char **fields, int *lengths)
+{
+  char name[COLUMN_NAME_LENGTH];
+  double time_delta, value;
+  int field_idx = 0;
+  int tidx, coordinate = 0, count = 0;
+  gps_segment_t *seg;
+  
+  if(numeric_parse(fields[0], lengths[0], &time_delta) != 0) {
+    return 0;
+  }
+  for(tidx = 0; tidx < template->segment_count; tidx++) {
+    seg = &template->segments[tidx];
+    if(!seg->is_value) {
+      continue;
+    }
+    if(lengths[field_idx] > 0 && seg->decode != GPS_TEXT &&
+       decode_gps_field(seg, fields, lengths, field_idx, &coordinate, &value) > 0) {
+      if(seg->column < 0) {
+        snprintf(name, sizeof(name), "%s.%s", template->type, template->fields[tidx]);
+        seg->column = column_writer_column(column_output, name);
+      }
+      if(column_writer_append(column_output, seg->column, (int64_t)time_delta, value) == 0) {
+        count++;
       }
-      free(fields);
     }
+    field_idx++;
   }
   
-  return result;
+  return count;
 }
 
-char *parse_simple_pid_stanza(stanza_t *stanza)
+// -m, consecutive records sharing a time_delta are written as one
+//   { "time_delta": t, "pids": { "10D": v, ... }, "accelerometer": { ... }, 
+//     "gps": { "gga": { ... }, ... } }
+// A member the pending record already holds starts a new one, so a pid 
+// repeated within a time_delta is not lost.
+typedef struct merge_str {
+  output_buffer_t *time_delta;
+  output_buffer_t *pids;
+  output_buffer_t *accelerometer;
+  output_buffer_t *gps;
+  long serial;                          // bumped for every record
+  long pid_serial[OBD_PID_COUNT];       // == serial when the record has it
+  long gps_serial[GPS_TEMPLATE_COUNT];
+} merge_t;
+
+merge_t *merge = NULL;
+
+merge_t *merge_create(void)
 {
-  int len;
-  char *result = NULL;
-  char *pid_template = "{ time_delta: %s, pid: \"%s\", value: %s }";
-  char *fields[3];
-  fields[0] = stanza->head;
-  fields[1] = stanza->head + stanza->commas[0] + 1;
-  fields[2] = stanza->head + stanza->commas[1] + 1;
-  *(stanza->head + stanza->commas[0]) = 0;
-  *(stanza->head + stanza->commas[1]) = 0;
+  merge_t *m = (merge_t *)calloc(1, sizeof(merge_t));
+  if(m) {
+    m->time_delta = output_buffer_create(64, -1);
+    m->pids = output_buffer_create(BUFFER_LENGTH, -1);
+    m->accelerometer = output_buffer_create(BUFFER_LENGTH, -1);
+    m->gps = output_buffer_create(BUFFER_LENGTH, -1);
+    m->serial = 1;
+    if(!m->time_delta || !m->pids || !m->accelerometer || !m->gps) {
+      output_buffer_destroy(m->time_delta);
+      output_buffer_destroy(m->pids);
+      output_buffer_destroy(m->accelerometer);
+      output_buffer_destroy(m->gps);
+      free(m);
+      m = NULL;
+    }
+  }
+  return m;
+}
+
+// Writes the pending record, if any, and empties it.
+int merge_flush(output_buffer_t *out)
+{
+  char *start, *p;
   
-  if(stanza && (stanza->comma_idx == 2)) {
-    len = strlen(pid_template) + stanza->length + 8;
-    result = (char *)calloc(len, sizeof(char));
-    snprintf(result, len, pid_template, fields[0], fields[1], fields[2]);
+  if(merge->time_delta->length == 0) {
+    return 0;
+  }
+  start = p = output_buffer_reserve(out, merge->time_delta->length + merge->pids->length + 
+                                    merge->accelerometer->length + merge->gps->length + 64);
+  if(!p) {
+    return -1;
   }
+  p = COPY_LITERAL(p, "{ \"time_delta\": ");
+  p = copy_out(p, merge->time_delta->data, merge->time_delta->length);
+  if(merge->pids->length > 0) {
+    p = COPY_LITERAL(p, ", \"pids\": { ");
+    p = copy_out(p, merge->pids->data, merge->pids->length);
+    p = COPY_LITERAL(p, " }");
+  }
+  if(merge->accelerometer->length > 0) {
+    p = COPY_LITERAL(p, ", \"accelerometer\": ");
+    p = copy_out(p, merge->accelerometer->data, merge->accelerometer->length);
+  }
+  if(merge->gps->length > 0) {
+    p = COPY_LITERAL(p, ", \"gps\": { ");
+    p = copy_out(p, merge->gps->data, merge->gps->length);
+    p = COPY_LITERAL(p, " }");
+  }
+  p = COPY_LITERAL(p, " }\n");
+  output_buffer_commit(out, p - start);
   
-  return result;
+  merge->time_delta->length = 0;
+  merge->pids->length = 0;
+  merge->accelerometer->length = 0;
+  merge->gps->length = 0;
+  merge->serial++;
+  
+  return p - start;
+}
+
+// Makes the pending record the one for the stanza's time_delta, writing 
+// the previous one out when it differs or already has the member.
+int merge_begin(stanza_t *stanza, int has_member, output_buffer_t *out)
+{
+  char *field;
+  int len;
+  
+  field = stanza_field(stanza, 0, &len);
+  if(!has_member && merge->time_delta->length == len && 
+     memcmp(merge->time_delta->data, field, len) == 0) {
+    return 0;
+  }
+  if(merge_flush(out) < 0) {
+    return -1;
+  }
+  return output_buffer_append(merge->time_delta, field, len);
 }
 
-char *parse_accelerometer_stanza(stanza_t *stanza)
+// Adds "key": to a section, members after the first are comma separated.
+// Returns where the value goes, NULL when there is no room for len more.
+// *start is where the member begins, reserving may have moved the section.
+char *merge_member(output_buffer_t *section, char *key, int key_len, int len, char **start)
 {
-  int len, i;
-  char *result = NULL;
-  char *pid_template = "{ \"time_delta\": %s, \"pid\": \"%s\", \"x_accel\": %s, \"y_accel\": %s, \"z_accel\": %s }";
-  char *fields[5];
-  fields[0] = stanza->head;
-  for(i = 1; i < 5; i++) {
-    fields[i] = stanza->head + stanza->commas[i - 1] + 1;
-    *(stanza->head + stanza->commas[i - 1]) = 0;
+  char *p = output_buffer_reserve(section, key_len + len + 6);
+  if(p) {
+    *start = p;
+    if(section->length > 0) {
+      p = COPY_LITERAL(p, ", ");
+    }
+    *p++ = '"';
+    p = copy_out(p, key, key_len);
+    p = COPY_LITERAL(p, "\": ");
   }
+  return p;
+}
+
+int merge_gps(gps_type_template_t *template, int template_idx, char **fields, int *lengths,
+              stanza_t *stanza, output_buffer_t *out)
+{
+  output_buffer_t *gps = merge->gps;
+  int type_len = strlen(template->type);
+  char *start, *p;
+  int len;
   
-  if(stanza && (stanza->comma_idx == 4)) {
-    len = strlen(pid_template) + stanza->length + 8;
-    result = (char *)calloc(len, sizeof(char));
-    snprintf(result, len, pid_template, fields[0], fields[1], fields[2], fields[3], fields[4]);
+  if(merge_begin(stanza, merge->gps_serial[template_idx] == merge->serial, out) < 0) {
+    return -1;
   }
+  len = stanza->length + template->template_len;
+  if(numeric_output) {
+    len += template->segment_count * NUMERIC_LENGTH;
+  }
+  p = merge_member(gps, template->type, type_len, len, &start);
+  if(!p) {
+    return -1;
+  }
+  // past "time_delta" and "type", the record carries those
+  len = populate_gps_template(template, 2, fields, lengths, p, len);
+  if(len < 0) {
+    return 0;
+  }
+  p += len;
+  output_buffer_commit(gps, p - start);
+  merge->gps_serial[template_idx] = merge->serial;
   
-  return result;
+  return p - start;
 }
 
-int is_gps_stanza(stanza_t *stanza)
+// Whether the pending pids hold key, for pids with no serial to go by.
+// Members are "key": value and pid values hold no commas.
+int merge_has_pid(char *key, int key_len)
 {
-  int is_gps = 0;
-  if(stanza->head[stanza->commas[1] + 1] && 
-       (stanza->commas[1] + 7 <= stanza->length)) {
-    if(strncmp("$GP", (stanza->head + stanza->commas[0] + 1), 3) == 0) {
-      is_gps = 1;
+  char *p = merge->pids->data, *end = merge->pids->data + merge->pids->length;
+  
+  while(p && p < end) {
+    if(end - p > key_len + 1 && p[0] == '"' && memcmp(p + 1, key, key_len) == 0 &&
+       p[key_len + 1] == '"') {
+      return 1;
+    }
+    p = memchr(p, ',', end - p);
+    if(p) {
+      p += 2;
     }
   }
+  return 0;
+}
+
+int merge_pid(stanza_t *stanza, int pid, const obd_pid_t *entry, output_buffer_t *out)
+{
+  output_buffer_t *pids = merge->pids;
+  char *start, *p, *field, *value;
+  double scaled;
+  int len, value_len, has_member;
   
-  return is_gps;
+  field = stanza_field(stanza, 1, &len);
+  has_member = pid >= 0 ? merge->pid_serial[pid] == merge->serial : merge_has_pid(field, len);
+  if(merge_begin(stanza, has_member, out) < 0) {
+    return -1;
+  }
+  value = stanza_field(stanza, 2, &value_len);
+  p = merge_member(pids, field, len, value_len + NUMERIC_LENGTH, &start);
+  if(!p) {
+    return -1;
+  }
+  if(entry && (entry->scale != 1 || entry->offset != 0) && 
+     numeric_parse(value, value_len, &scaled) == 0) {
+    p += numeric_format(scaled * entry->scale + entry->offset, p, NUMERIC_LENGTH);
+  } else {
+    p = copy_out(p, value, value_len);
+  }
+  output_buffer_commit(pids, p - start);
+  if(pid >= 0) {
+    merge->pid_serial[pid] = merge->serial;
+  }
+  
+  return p - start;
 }
 
+int merge_accelerometer(stanza_t *stanza, output_buffer_t *out)
+{
+  static char *keys[] = { "{ \"x_accel\": ", ", \"y_accel\": ", ", \"z_accel\": " };
+  output_buffer_t *accelerometer = merge->accelerometer;
+  char *start, *p, *field;
+  int i, len;
+  
+  if(merge_begin(stanza, accelerometer->length > 0, out) < 0) {
+    return -1;
+  }
+  start = p = output_buffer_reserve(accelerometer, stanza->length + 64);
+  if(!p) {
+    return -1;
+  }
+  for(i = 0; i < 3; i++) {
+    p = copy_out(p, keys[i], strlen(keys[i]));
+    field = stanza_field(stanza, i + 2, &len);
+    p = copy_out(p, field, len);
+  }
+  p = COPY_LITERAL(p, " }");
+  output_buffer_commit(accelerometer, p - start);
+  
+  return p - start;
+}
 
-char *parse_stanza(stanza_t *stanza)
+// Parsers render one line of json into out and return the bytes written, 
+// 0 when the stanza produced nothing, -1 when out can't take it.
+int parse_gps_stanza(stanza_t *stanza, int template_idx, output_buffer_t *out)
 {
-  // is this a GPS stanza?
-  char *result = NULL;
-  int i;
+  char *fields[GPS_MAX_FIELDS];
+  int lengths[GPS_MAX_FIELDS];
+  gps_type_template_t *template;
+  char *buffer;
+  int len, field_cnt;
+  
+  if(template_idx < 0) {
+    return 0;
+  }
+  template = &gps_templates[template_idx];
+  field_cnt = template->expected_commas;
+  if(field_cnt + 4 > GPS_MAX_FIELDS) {
+    return 0;
+  }
   
+  memset(fields, 0, sizeof(fields));
+  memset(lengths, 0, sizeof(lengths));
+  if(parse_gps_fields(stanza, template->min_commas, field_cnt, fields, lengths) != 0) {
+    return 0;
+  }
+  fields[1] = fields[0];
+  lengths[1] = lengths[0];
   
+  if(output_format == OUTPUT_COLUMNS) {
+    return populate_gps_columns(template, fields + 1, lengths + 1);
+  }
   
-  if(stanza->comma_idx > 2) {
-    if(is_gps_stanza(stanza)) {
-      i = 0;
-      while(gps_templates[i].type != NULL) {
-        if(strncasecmp(gps_templates[i].type, (stanza->head + stanza->commas[0] + 4), 3) == 0) {
-          break;
-        }
-        i++;
-      }
-      
-      if(gps_templates[i].type != NULL) {
-        result = parse_gps_stanza(stanza, i);
-      } else {
-        stanza->head[stanza->commas[0] + 7] = 0;
-        fprintf(stderr, "Error - Unknown GPS stanza type: %s\n", (stanza->head + stanza->commas[0] + 4));
-      }
-    } else if(stanza->comma_idx == 4) {
-      // check to see if it is accelerator data
-      if(strncasecmp(stanza->head + stanza->commas[0] + 1, "20,", 3) == 0) {
-        result = parse_accelerometer_stanza(stanza);
-      }
+  if(output_format == OUTPUT_CBOR) {
+    len = stanza->length + template->cbor_len + template->segment_count * CBOR_MAX_HEAD;
+    buffer = output_buffer_reserve(out, len);
+    if(!buffer) {
+      return -1;
     }
-  } else if(stanza->comma_idx == 2) {
-    // treat as a simple pid value_len
-    result = parse_simple_pid_stanza(stanza);
+    len = populate_gps_cbor(template, fields + 1, lengths + 1, buffer, len);
+    if(len < 0) {
+      return 0;
+    }
+    output_buffer_commit(out, len);
+    return len;
   }
   
-  return result;
+  if(merge) {
+    return merge_gps(template, template_idx, fields + 1, lengths + 1, stanza, out);
+  }
+  len = stanza->length + template->template_len + 1;
+  if(numeric_output) {
+    len += template->segment_count * NUMERIC_LENGTH;
+  }
+  buffer = output_buffer_reserve(out, len);
+  if(!buffer) {
+    return -1;
+  }
+  len = populate_gps_template(template, 0, fields + 1, lengths + 1, buffer, len);
+  if(len < 0) {
+    return 0;
+  }
+  buffer[len++] = '\n';
+  output_buffer_commit(out, len);
+  
+  return len;
 }
 
-int main(int argc, char **argv)
+// column index per pid, named after the pid table where it has an entry
+int pid_columns[OBD_PID_COUNT];
+
+int parse_simple_pid_columns(stanza_t *stanza, int pid, const obd_pid_t *entry)
 {
-  gps_templates = generate_gps_templates();
+  char name[COLUMN_NAME_LENGTH];
+  double time_delta, value;
+  char *field;
+  int len;
   
-  stanza_t *stanza = calloc(1, sizeof(stanza_t));
-  ds_source_state_t *src = ds_open_file(argv[1], BUFFER_LENGTH);
-  while(read_stanza(src, stanza) > 0) {
-    char *s = parse_stanza(stanza);
-    if(s) {
-      fprintf(stdout, "%s\n", s);
-      free(s);
+  field = stanza_field(stanza, 0, &len);
+  if(numeric_parse(field, len, &time_delta) != 0) {
+    return 0;
+  }
+  field = stanza_field(stanza, 2, &len);
+  if(numeric_parse(field, len, &value) != 0) {
+    return 0;
+  }
+  if(entry) {
+    value = value * entry->scale + entry->offset;
+  }
+  
+  if(pid < 0) {
+    return 0;
+  }
+  if(pid_columns[pid] < 0) {
+    if(entry) {
+      snprintf(name, sizeof(name), "%s", entry->name);
+    } else {
+      snprintf(name, sizeof(name), "pid_%03X", pid);
     }
+    pid_columns[pid] = column_writer_column(column_output, name);
   }
-  ds_close_file(src);
-  delete_stanza(stanza);
-}
\ No newline at end of file
+  
+  return column_writer_append(column_output, pid_columns[pid], (int64_t)time_delta, value) == 0;
+}
+
+int parse_simple_pid_cbor(stanza_t *stanza, const obd_pid_t *entry, output_buffer_t *out)
+{
+  char *field, *start, *p;
+  double value;
+  int len;
+  
+  len = stanza->length + 64 + 3 * CBOR_MAX_HEAD;
+  if(entry) {
+    len += strlen(entry->name) + strlen(entry->unit) + 2 * CBOR_MAX_HEAD;
+  }
+  start = p = output_buffer_reserve(out, len);
+  if(!p) {
+    return -1;
+  }
+  p += CBOR_FRAME_HEADER;
+  *p++ = (char)CBOR_MAP_BEGIN;
+  p = CBOR_LITERAL(p, "time_delta");
+  field = stanza_field(stanza, 0, &len);
+  p = cbor_put_field(p, field, len);
+  p = CBOR_LITERAL(p, "pid");
+  field = stanza_field(stanza, 1, &len);
+  p = cbor_put_text(p, field, len);
+  if(entry) {
+    p = CBOR_LITERAL(p, "name");
+    p = cbor_put_text(p, entry->name, strlen(entry->name));
+    p = CBOR_LITERAL(p, "unit");
+    p = cbor_put_text(p, entry->unit, strlen(entry->unit));
+  }
+  p = CBOR_LITERAL(p, "value");
+  field = stanza_field(stanza, 2, &len);
+  if(entry && numeric_parse(field, len, &value) == 0) {
+    p = cbor_put_number(p, value * entry->scale + entry->offset);
+  } else {
+    p = cbor_put_field(p, field, len);
+  }
+  *p++ = (char)CBOR_BREAK;
+  cbor_frame_set_length(start, p - start - CBOR_FRAME_HEADER);
+  output_buffer_commit(out, p - start);
+  
+  return p - start;
+}
+
+// Running summary of one pid, or one accelerometer axis, over the window
+// it is in.  A sample from a later window closes and emits it.
+typedef struct aggregate_str {
+  long   window;          // window number, -1 when nothing is collected
+  long   count;
+  double min;
+  double max;
+  double sum;
+  double sum_squares;     // rms, accelerometer only
+  double last;
+} aggregate_t;
+
+aggregate_t pid_aggregates[OBD_PID_COUNT];
+aggregate_t accelerometer_aggregates[3];
+
+void aggregate_reset(aggregate_t *agg, long window)
+{
+  agg->window = window;
+  agg->count = 0;
+  agg->sum = 0;
+  agg->sum_squares = 0;
+}
+
+void aggregate_add(aggregate_t *agg, double value)
+{
+  if(agg->count == 0 || value < agg->min) {
+    agg->min = value;
+  }
+  if(agg->count == 0 || value > agg->max) {
+    agg->max = value;
+  }
+  agg->count++;
+  agg->sum += value;
+  agg->sum_squares += value * value;
+  agg->last = value;
+}
+
+char *put_number(char *p, double value)
+{
+  return p + numeric_format(value, p, NUMERIC_LENGTH);
+}
+
+#define AGGREGATE_LENGTH (256 + 16 * NUMERIC_LENGTH)
+
+// Writes the finished window of a pid, returns the bytes written.
+int emit_pid_aggregate(int pid, aggregate_t *agg, output_buffer_t *out)
+{
+  const obd_pid_t *entry = obd_pid_entry(pid);
+  char pid_text[8];
+  char *start, *p;
+  int len;
+  
+  if(agg->count == 0) {
+    return 0;
+  }
+  start = p = output_buffer_reserve(out, AGGREGATE_LENGTH);
+  if(!p) {
+    return -1;
+  }
+  len = snprintf(pid_text, sizeof(pid_text), "%X", pid);
+  
+  if(output_format == OUTPUT_CBOR) {
+    p += CBOR_FRAME_HEADER;
+    *p++ = (char)CBOR_MAP_BEGIN;
+    p = CBOR_LITERAL(p, "time_delta");
+    p = cbor_put_int(p, (int64_t)agg->window * aggregate_window);
+    p = CBOR_LITERAL(p, "pid");
+    p = cbor_put_text(p, pid_text, len);
+    if(entry) {
+      p = CBOR_LITERAL(p, "name");
+      p = cbor_put_text(p, entry->name, strlen(entry->name));
+      p = CBOR_LITERAL(p, "unit");
+      p = cbor_put_text(p, entry->unit, strlen(entry->unit));
+    }
+    p = CBOR_LITERAL(p, "window");
+    p = cbor_put_int(p, aggregate_window);
+    p = CBOR_LITERAL(p, "count");
+    p = cbor_put_int(p, agg->count);
+    p = CBOR_LITERAL(p, "min");
+    p = cbor_put_number(p, agg->min);
+    p = CBOR_LITERAL(p, "max");
+    p = cbor_put_number(p, agg->max);
+    p = CBOR_LITERAL(p, "mean");
+    p = cbor_put_number(p, agg->sum / agg->count);
+    p = CBOR_LITERAL(p, "last");
+    p = cbor_put_number(p, agg->last);
+    *p++ = (char)CBOR_BREAK;
+    cbor_frame_set_length(start, p - start - CBOR_FRAME_HEADER);
+  } else {
+    p = COPY_LITERAL(p, "{ time_delta: ");
+    p = put_number(p, (double)agg->window * aggregate_window);
+    p = COPY_LITERAL(p, ", pid: \"");
+    p = copy_out(p, pid_text, len);
+    if(entry) {
+      p = COPY_LITERAL(p, "\", name: \"");
+      p = copy_out(p, entry->name, strlen(entry->name));
+      p = COPY_LITERAL(p, "\", unit: \"");
+      p = copy_out(p, entry->unit, strlen(entry->unit));
+    }
+    p = COPY_LITERAL(p, "\", window: ");
+    p = put_number(p, aggregate_window);
+    p = COPY_LITERAL(p, ", count: ");
+    p = put_number(p, agg->count);
+    p = COPY_LITERAL(p, ", min: ");
+    p = put_number(p, agg->min);
+    p = COPY_LITERAL(p, ", max: ");
+    p = put_number(p, agg->max);
+    p = COPY_LITERAL(p, ", mean: ");
+    p = put_number(p, agg->sum / agg->count);
+    p = COPY_LITERAL(p, ", last: ");
+    p = put_number(p, agg->last);
+    p = COPY_LITERAL(p, " }\n");
+  }
+  output_buffer_commit(out, p - start);
+  agg->count = 0;
+  
+  return p - start;
+}
+
+// The three axes share their window, the record carries rms on top.
+int emit_accelerometer_aggregate(output_buffer_t *out)
+{
+  static char *axes[] = { "x_accel", "y_accel", "z_accel" };
+  aggregate_t *agg;
+  char *start, *p;
+  int i;
+  
+  if(accelerometer_aggregates[0].count == 0) {
+    return 0;
+  }
+  start = p = output_buffer_reserve(out, AGGREGATE_LENGTH);
+  if(!p) {
+    return -1;
+  }
+  
+  if(output_format == OUTPUT_CBOR) {
+    p += CBOR_FRAME_HEADER;
+    *p++ = (char)CBOR_MAP_BEGIN;
+    p = CBOR_LITERAL(p, "time_delta");
+    p = cbor_put_int(p, (int64_t)accelerometer_aggregates[0].window * aggregate_window);
+    p = CBOR_LITERAL(p, "pid");
+    p = CBOR_LITERAL(p, "20");
+    p = CBOR_LITERAL(p, "window");
+    p = cbor_put_int(p, aggregate_window);
+    p = CBOR_LITERAL(p, "count");
+    p = cbor_put_int(p, accelerometer_aggregates[0].count);
+    for(i = 0; i < 3; i++) {
+      agg = &accelerometer_aggregates[i];
+      p = cbor_put_text(p, axes[i], strlen(axes[i]));
+      *p++ = (char)CBOR_MAP_BEGIN;
+      p = CBOR_LITERAL(p, "min");
+      p = cbor_put_number(p, agg->min);
+      p = CBOR_LITERAL(p, "max");
+      p = cbor_put_number(p, agg->max);
+      p = CBOR_LITERAL(p, "mean");
+      p = cbor_put_number(p, agg->sum / agg->count);
+      p = CBOR_LITERAL(p, "last");
+      p = cbor_put_number(p, agg->last);
+      p = CBOR_LITERAL(p, "rms");
+      p = cbor_put_number(p, sqrt(agg->sum_squares / agg->count));
+      *p++ = (char)CBOR_BREAK;
+      agg->count = 0;
+    }
+    *p++ = (char)CBOR_BREAK;
+    cbor_frame_set_length(start, p - start - CBOR_FRAME_HEADER);
+  } else {
+    p = COPY_LITERAL(p, "{ \"time_delta\": ");
+    p = put_number(p, (double)accelerometer_aggregates[0].window * aggregate_window);
+    p = COPY_LITERAL(p, ", \"pid\": \"20\", \"window\": ");
+    p = put_number(p, aggregate_window);
+    p = COPY_LITERAL(p, ", \"count\": ");
+    p = put_number(p, accelerometer_aggregates[0].count);
+    for(i = 0; i < 3; i++) {
+      agg = &accelerometer_aggregates[i];
+      p = COPY_LITERAL(p, ", \"");
+      p = copy_out(p, axes[i], strlen(axes[i]));
+      p = COPY_LITERAL(p, "\": { \"min\": ");
+      p = put_number(p, agg->min);
+      p = COPY_LITERAL(p, ", \"max\": ");
+      p = put_number(p, agg->max);
+      p = COPY_LITERAL(p, ", \"mean\": ");
+      p = put_number(p, agg->sum / agg->count);
+      p = COPY_LITERAL(p, ", \"last\": ");
+      p = put_number(p, agg->last);
+      p = COPY_LITERAL(p, ", \"rms\": ");
+      p = put_number(p, sqrt(agg->sum_squares / agg->count));
+      p = COPY_LITERAL(p, " }");
+      agg->count = 0;
+    }
+    p = COPY_LITERAL(p, " }\n");
+  }
+  output_buffer_commit(out, p - start);
+  
+  return p - start;
+}
+
+long aggregate_window_of(double time_delta)
+{
+  return (long)floor(time_delta / aggregate_window);
+}
+
+// Folds a pid sample into its window.  Returns the bytes of the window it 
+// closed, if any.
+int aggregate_pid_sample(stanza_t *stanza, int pid, const obd_pid_t *entry, output_buffer_t *out)
+{
+  aggregate_t *agg = &pid_aggregates[pid];
+  double time_delta, value;
+  char *field;
+  long window;
+  int len, r = 0;
+  
+  field = stanza_field(stanza, 0, &len);
+  if(numeric_parse(field, len, &time_delta) != 0) {
+    return 0;
+  }
+  field = stanza_field(stanza, 2, &len);
+  if(numeric_parse(field, len, &value) != 0) {
+    return 0;
+  }
+  if(entry) {
+    value = value * entry->scale + entry->offset;
+  }
+  
+  window = aggregate_window_of(time_delta);
+  if(agg->count > 0 && agg->window != window) {
+    r = emit_pid_aggregate(pid, agg, out);
+  }
+  if(agg->count == 0) {
+    aggregate_reset(agg, window);
+  }
+  aggregate_add(agg, value);
+  
+  return r;
+}
+
+int aggregate_accelerometer_sample(stanza_t *stanza, output_buffer_t *out)
+{
+  double time_delta, values[3];
+  char *field;
+  long window;
+  int i, len, r = 0;
+  
+  field = stanza_field(stanza, 0, &len);
+  if(numeric_parse(field, len, &time_delta) != 0) {
+    return 0;
+  }
+  for(i = 0; i < 3; i++) {
+    field = stanza_field(stanza, i + 2, &len);
+    if(numeric_parse(field, len, &values[i]) != 0) {
+      return 0;
+    }
+  }
+  
+  window = aggregate_window_of(time_delta);
+  if(accelerometer_aggregates[0].count > 0 && accelerometer_aggregates[0].window != window) {
+    r = emit_accelerometer_aggregate(out);
+  }
+  for(i = 0; i < 3; i++) {
+    if(accelerometer_aggregates[i].count == 0) {
+      aggregate_reset(&accelerometer_aggregates[i], window);
+    }
+    aggregate_add(&accelerometer_aggregates[i], values[i]);
+  }
+  
+  return r;
+}
+
+// emit every window still open at the end of the input
+int flush_aggregates(output_buffer_t *out)
+{
+  int pid;
+  
+  for(pid = 0; pid < OBD_PID_COUNT; pid++) {
+    if(emit_pid_aggregate(pid, &pid_aggregates[pid], out) < 0) {
+      return -1;
+    }
+  }
+  return emit_accelerometer_aggregate(out) < 0 ? -1 : 0;
+}
+
+// Last value written per pid.  Only the thread reading in order touches
+// it, deadband disables -j.
+typedef struct deadband_str {
+  double value;
+  double time_delta;      // NAN until the pid is first written
+} deadband_t;
+
+deadband_t pid_deadband[OBD_PID_COUNT];
+
+void deadband_init(void)
+{
+  int pid;
+  
+  for(pid = 0; pid < OBD_PID_COUNT; pid++) {
+    pid_deadband[pid].time_delta = NAN;
+  }
+}
+
+// 1 when the sample has not moved far enough from the last value written 
+// and no keyframe is due
+int deadband_suppress(stanza_t *stanza, int pid, const obd_pid_t *entry)
+{
+  deadband_t *last = &pid_deadband[pid];
+  double time_delta, value, threshold;
+  char *field;
+  int len;
+  
+  field = stanza_field(stanza, 0, &len);
+  if(numeric_parse(field, len, &time_delta) != 0) {
+    return 0;
+  }
+  field = stanza_field(stanza, 2, &len);
+  if(numeric_parse(field, len, &value) != 0) {
+    return 0;
+  }
+  if(entry) {
+    value = value * entry->scale + entry->offset;
+  }
+  
+  if(!isnan(last->time_delta) && 
+     (deadband_keyframe == 0 || time_delta - last->time_delta < deadband_keyframe)) {
+    threshold = fmax(deadband_absolute, deadband_relative * fabs(last->value));
+    if(fabs(value - last->value) <= threshold) {
+      return 1;
+    }
+  }
+  last->value = value;
+  last->time_delta = time_delta;
+  
+  return 0;
+}
+
+// Known pids get their name, unit and the value scaled to that unit, 
+// anything else is passed through as logged.
+int parse_simple_pid_stanza(stanza_t *stanza, output_buffer_t *out)
+{
+  const obd_pid_t *entry;
+  char *field, *start, *p;
+  double value;
+  int len, pid;
+  
+  if(!stanza || (stanza->comma_idx != 2)) {
+    return 0;
+  }
+  
+  field = stanza_field(stanza, 1, &len);
+  pid = obd_pid_index(field, len);
+  entry = obd_pid_entry(pid);
+  if(aggregate_window > 0 && pid >= 0) {
+    return aggregate_pid_sample(stanza, pid, entry, out);
+  }
+  if(deadband && pid >= 0 && deadband_suppress(stanza, pid, entry)) {
+    return 0;
+  }
+  if(output_format == OUTPUT_COLUMNS) {
+    return parse_simple_pid_columns(stanza, pid, entry);
+  } else if(output_format == OUTPUT_CBOR) {
+    return parse_simple_pid_cbor(stanza, entry, out);
+  } else if(merge) {
+    return merge_pid(stanza, pid, entry, out);
+  }
+  if(entry) {
+    len = strlen(entry->name) + strlen(entry->unit) + NUMERIC_LENGTH;
+  } else {
+    len = 0;
+  }
+  start = p = output_buffer_reserve(out, stanza->length + 48 + len);
+  if(!p) {
+    return -1;
+  }
+  p = COPY_LITERAL(p, "{ time_delta: ");
+  field = stanza_field(stanza, 0, &len);
+  p = copy_out(p, field, len);
+  p = COPY_LITERAL(p, ", pid: \"");
+  field = stanza_field(stanza, 1, &len);
+  p = copy_out(p, field, len);
+  if(entry) {
+    p = COPY_LITERAL(p, "\", name: \"");
+    p = copy_out(p, entry->name, strlen(entry->name));
+    p = COPY_LITERAL(p, "\", unit: \"");
+    p = copy_out(p, entry->unit, strlen(entry->unit));
+  }
+  p = COPY_LITERAL(p, "\", value: ");
+  field = stanza_field(stanza, 2, &len);
+  if(entry && (entry->scale != 1 || entry->offset != 0) && 
+     numeric_parse(field, len, &value) == 0) {
+    p += numeric_format(value * entry->scale + entry->offset, p, NUMERIC_LENGTH);
+  } else {
+    p = copy_out(p, field, len);
+  }
+  p = COPY_LITERAL(p, " }\n");
+  output_buffer_commit(out, p - start);
+  
+  return p - start;
+}
+
+int accelerometer_columns[3] = { -1, -1, -1 };
+
+int parse_accelerometer_columns(stanza_t *stanza)
+{
+  static char *names[] = { "accelerometer.x", "accelerometer.y", "accelerometer.z" };
+  double time_delta, value;
+  char *field;
+  int i, len, count = 0;
+  
+  field = stanza_field(stanza, 0, &len);
+  if(numeric_parse(field, len, &time_delta) != 0) {
+    return 0;
+  }
+  for(i = 0; i < 3; i++) {
+    field = stanza_field(stanza, i + 2, &len);
+    if(numeric_parse(field, len, &value) != 0) {
+      continue;
+    }
+    if(accelerometer_columns[i] < 0) {
+      accelerometer_columns[i] = column_writer_column(column_output, names[i]);
+    }
+    if(column_writer_append(column_output, accelerometer_columns[i], (int64_t)time_delta, value) == 0) {
+      count++;
+    }
+  }
+  
+  return count;
+}
+
+int parse_accelerometer_stanza(stanza_t *stanza, output_buffer_t *out)
+{
+  static char *keys[] = { "{ \"time_delta\": ", ", \"pid\": \"", "\", \"x_accel\": ", 
+                          ", \"y_accel\": ", ", \"z_accel\": " };
+  static char *cbor_keys[] = { "time_delta", "pid", "x_accel", "y_accel", "z_accel" };
+  char *field, *start, *p;
+  int i, len;
+  
+  if(!stanza || (stanza->comma_idx != 4)) {
+    return 0;
+  }
+  if(output_format == OUTPUT_COLUMNS) {
+    return parse_accelerometer_columns(stanza);
+  } else if(aggregate_window > 0) {
+    return aggregate_accelerometer_sample(stanza, out);
+  } else if(merge) {
+    return merge_accelerometer(stanza, out);
+  }
+  
+  start = p = output_buffer_reserve(out, stanza->length + 96);
+  if(!p) {
+    return -1;
+  }
+  if(output_format == OUTPUT_CBOR) {
+    p += CBOR_FRAME_HEADER;
+    *p++ = (char)CBOR_MAP_BEGIN;
+    for(i = 0; i < 5; i++) {
+      p = cbor_put_text(p, cbor_keys[i], strlen(cbor_keys[i]));
+      field = stanza_field(stanza, i, &len);
+      p = i == 1 ? cbor_put_text(p, field, len) : cbor_put_field(p, field, len);
+    }
+    *p++ = (char)CBOR_BREAK;
+    cbor_frame_set_length(start, p - start - CBOR_FRAME_HEADER);
+    output_buffer_commit(out, p - start);
+    return p - start;
+  }
+  for(i = 0; i < 5; i++) {
+    p = copy_out(p, keys[i], strlen(keys[i]));
+    field = stanza_field(stanza, i, &len);
+    p = copy_out(p, field, len);
+  }
+  p = COPY_LITERAL(p, " }\n");
+  output_buffer_commit(out, p - start);
+  
+  return p - start;
+}
+
+// $GP gps, $GL glonass, $GA galileo, $GB beidou, $GN combined fixes
+int is_gps_stanza(stanza_t *stanza)
+{
+  int is_gps = 0;
+  char *talker = stanza->head + stanza->commas[0] + 1;
+  if(stanza->commas[1] - stanza->commas[0] == 7) {
+    if(talker[0] == '$' && talker[1] == 'G' && talker[2] && strchr("PLABN", talker[2])) {
+      is_gps = 1;
+    }
+  }
+  
+  return is_gps;
+}
+
+#define MAX_UNKNOWN_TYPES 32
+
+// Sentence types without a template are reported once and counted, a 
+// receiver emitting one every fix would otherwise flood stderr.
+typedef struct unknown_gps_type_str {
+  char type[4];
+  long count;
+} unknown_gps_type_t;
+
+pthread_mutex_t unknown_gps_mutex = PTHREAD_MUTEX_INITIALIZER;
+unknown_gps_type_t unknown_gps_types[MAX_UNKNOWN_TYPES];
+long unknown_gps_other = 0;
+
+void count_unknown_gps_type(char *type)
+{
+  int i;
+  
+  pthread_mutex_lock(&unknown_gps_mutex);
+  for(i = 0; i < MAX_UNKNOWN_TYPES && unknown_gps_types[i].count > 0; i++) {
+    if(strncmp(unknown_gps_types[i].type, type, 3) == 0) {
+      break;
+    }
+  }
+  if(i == MAX_UNKNOWN_TYPES) {
+    unknown_gps_other++;
+  } else {
+    if(unknown_gps_types[i].count == 0) {
+      memcpy(unknown_gps_types[i].type, type, 3);
+      fprintf(stderr, "Error - Unknown GPS stanza type: %s (further ones are counted)\n", unknown_gps_types[i].type);
+    }
+    unknown_gps_types[i].count++;
+  }
+  pthread_mutex_unlock(&unknown_gps_mutex);
+}
+
+// Per sentence type counts, bumped from the conversion threads.  Invalid
+// sentences failed their checksum, dropped ones produced no output.
+typedef struct gps_stats_str {
+  long valid;
+  long invalid;
+  long dropped;
+} gps_stats_t;
+
+gps_stats_t gps_stats[GPS_TEMPLATE_COUNT];
+
+// sentences failing their checksum go here instead of being dropped
+FILE *quarantine_file = NULL;
+
+void report_gps_stats(void)
+{
+  int i;
+  
+  for(i = 0; i < GPS_TEMPLATE_COUNT; i++) {
+    if(gps_stats[i].valid || gps_stats[i].invalid) {
+      fprintf(stderr, "%s: %ld valid, %ld invalid, %ld dropped\n", gps_templates[i].type,
+              gps_stats[i].valid, gps_stats[i].invalid, gps_stats[i].dropped);
+    }
+  }
+  for(i = 0; i < MAX_UNKNOWN_TYPES && unknown_gps_types[i].count > 0; i++) {
+    fprintf(stderr, "Skipped %ld GPS stanzas of unknown type %s\n", 
+            unknown_gps_types[i].count, unknown_gps_types[i].type);
+  }
+  if(unknown_gps_other > 0) {
+    fprintf(stderr, "Skipped %ld GPS stanzas of other unknown types\n", unknown_gps_other);
+  }
+}
+
+int hex_value(char c)
+{
+  if(c >= '0' && c <= '9') {
+    return c - '0';
+  } else if(c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  } else if(c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// The checksum covers everything between '$' and '*'.  read_stanza already
+// xor'ed the whole line, so only the bytes outside that range are undone.
+int gps_checksum_ok(stanza_t *stanza)
+{
+  int prefix = stanza->commas[0] + 2;
+  char *checksum = stanza->head + stanza->length - 2;
+  unsigned char x = stanza->xor_sum;
+  int idx, hi, lo;
+  
+  if(stanza->length < prefix + 3 || checksum[-1] != '*') {
+    return 0;
+  }
+  hi = hex_value(checksum[0]);
+  lo = hex_value(checksum[1]);
+  if(hi < 0 || lo < 0) {
+    return 0;
+  }
+  
+  for(idx = 0; idx < prefix; idx++) {
+    x ^= (unsigned char)stanza->head[idx];
+  }
+  x ^= '*' ^ (unsigned char)checksum[0] ^ (unsigned char)checksum[1];
+  
+  return x == ((hi << 4) | lo);
+}
+
+void quarantine_stanza(stanza_t *stanza)
+{
+  flockfile(quarantine_file);
+  fwrite(stanza->head, 1, stanza->length, quarantine_file);
+  fputc('\n', quarantine_file);
+  funlockfile(quarantine_file);
+}
+
+int parse_stanza(stanza_t *stanza, output_buffer_t *out)
+{
+  // is this a GPS stanza?
+  int result = 0;
+  int i;
+  
+  if(stanza->comma_idx > 2) {
+    if(is_gps_stanza(stanza)) {
+      i = gps_template_index(stanza->head + stanza->commas[0] + 4);
+      if(i < 0) {
+        count_unknown_gps_type(stanza->head + stanza->commas[0] + 4);
+      } else if(gps_checksum_ok(stanza)) {
+        __atomic_fetch_add(&gps_stats[i].valid, 1, __ATOMIC_RELAXED);
+        result = parse_gps_stanza(stanza, i, out);
+        if(result == 0) {
+          __atomic_fetch_add(&gps_stats[i].dropped, 1, __ATOMIC_RELAXED);
+        }
+      } else {
+        __atomic_fetch_add(&gps_stats[i].invalid, 1, __ATOMIC_RELAXED);
+        if(quarantine_file) {
+          quarantine_stanza(stanza);
+        } else {
+          __atomic_fetch_add(&gps_stats[i].dropped, 1, __ATOMIC_RELAXED);
+        }
+      }
+    } else if(stanza->comma_idx == 4) {
+      // check to see if it is accelerator data
+      if(obd_pid_index(stanza->head + stanza->commas[0] + 1, 
+                       stanza->commas[1] - stanza->commas[0] - 1) == OBD_PID_ACC) {
+        result = parse_accelerometer_stanza(stanza, out);
+      }
+    }
+  } else if(stanza->comma_idx == 2) {
+    // treat as a simple pid value_len
+    result = parse_simple_pid_stanza(stanza, out);
+  }
+  
+  return result;
+}
+
+// One newline aligned slice of the input and the json rendered from it.
+typedef struct chunk_str {
+  char *start;
+  long length;
+  output_buffer_t *out;
+  int  done;
+  int  error;           // the output is cut short
+} chunk_t;
+
+// Workers claim chunks in file order, the main thread writes them out in
+// the same order.  A chunk slot is only reused once it has been written, 
+// so at most slot_count chunks of output are held at any time.
+typedef struct parallel_state_str {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  
+  char *data;
+  long length;
+  long next_offset;     // start of the next unclaimed chunk
+  long next_chunk;      // sequence number of the next unclaimed chunk
+  long written_chunk;   // sequence number the writer is waiting on
+  
+  chunk_t *slots;
+  int  slot_count;
+} parallel_state_t;
+
+// end the chunk on a line boundary at or after end
+char *chunk_end(char *end, char *limit)
+{
+  while(end < limit && *end != '\r' && *end != '\n') {
+    end++;
+  }
+  while(end < limit && (*end == '\r' || *end == '\n')) {
+    end++;
+  }
+  return end;
+}
+
+int convert_chunk(chunk_t *chunk, stanza_t *stanza)
+{
+  ds_source_state_t *src = ds_open_memory(chunk->start, chunk->length, BUFFER_LENGTH);
+  int rc = 0;
+  
+  if(!src) {
+    return -1;
+  }
+  while(read_stanza(src, stanza) > 0) {
+    if(parse_stanza(stanza, chunk->out) < 0) {
+      rc = -1;
+      break;
+    }
+  }
+  ds_close_file(src);
+  
+  return rc;
+}
+
+void *parallel_worker(void *arg)
+{
+  parallel_state_t *ps = (parallel_state_t *)arg;
+  stanza_t *stanza = calloc(1, sizeof(stanza_t));
+  chunk_t *chunk;
+  char *start, *end;
+  
+  while(1) {
+    pthread_mutex_lock(&ps->mutex);
+    while(ps->next_offset < ps->length && 
+          ps->next_chunk - ps->written_chunk >= ps->slot_count) {
+      pthread_cond_wait(&ps->cond, &ps->mutex);
+    }
+    if(ps->next_offset >= ps->length) {
+      pthread_mutex_unlock(&ps->mutex);
+      break;
+    }
+    chunk = &ps->slots[ps->next_chunk % ps->slot_count];
+    ps->next_chunk++;
+    start = ps->data + ps->next_offset;
+    end = start + PARALLEL_CHUNK;
+    if(end > ps->data + ps->length) {
+      end = ps->data + ps->length;
+    }
+    end = chunk_end(end, ps->data + ps->length);
+    ps->next_offset = end - ps->data;
+    pthread_mutex_unlock(&ps->mutex);
+    
+    chunk->start = start;
+    chunk->length = end - start;
+    chunk->out->length = 0;
+    chunk->error = !stanza || convert_chunk(chunk, stanza) != 0;
+    
+    pthread_mutex_lock(&ps->mutex);
+    chunk->done = 1;
+    pthread_cond_broadcast(&ps->cond);
+    pthread_mutex_unlock(&ps->mutex);
+  }
+  
+  delete_stanza(stanza);
+  return NULL;
+}
+
+// Convert a fully mapped input on several threads, output order matches 
+// the input.  When no thread can be set up the input is left as it was
+// for the caller to convert on its own.
+int convert_parallel(ds_source_state_t *src, int threads)
+{
+  parallel_state_t ps;
+  pthread_t workers[MAX_THREADS];
+  struct iovec iov[MAX_THREADS * 2];
+  chunk_t *chunk;
+  int i, count, failed, started = 0, rc = 0;
+  
+  memset(&ps, 0, sizeof(ps));
+  pthread_mutex_init(&ps.mutex, NULL);
+  pthread_cond_init(&ps.cond, NULL);
+  ps.data = src->current;
+  ps.length = src->length - (src->current - src->buffer);
+  ps.slot_count = threads * 2;
+  ps.slots = (chunk_t *)calloc(ps.slot_count, sizeof(chunk_t));
+  if(!ps.slots) {
+    fprintf(stderr, "Unable to allocate conversion threads, converting on one\n");
+    return 0;
+  }
+  for(i = 0; i < ps.slot_count; i++) {
+    ps.slots[i].out = output_buffer_create(PARALLEL_CHUNK, -1);
+    if(!ps.slots[i].out) {
+      while(i-- > 0) {
+        output_buffer_destroy(ps.slots[i].out);
+      }
+      free(ps.slots);
+      fprintf(stderr, "Unable to allocate conversion threads, converting on one\n");
+      return 0;
+    }
+  }
+  
+  for(i = 0; i < threads; i++) {
+    if(pthread_create(&workers[i], NULL, parallel_worker, &ps) == 0) {
+      started++;
+    }
+  }
+  
+  if(started == 0) {
+    fprintf(stderr, "Unable to start conversion threads, converting on one\n");
+  } else {
+    while(1) {
+      pthread_mutex_lock(&ps.mutex);
+      chunk = &ps.slots[ps.written_chunk % ps.slot_count];
+      while(!chunk->done && 
+            !(ps.next_offset >= ps.length && ps.written_chunk == ps.next_chunk)) {
+        pthread_cond_wait(&ps.cond, &ps.mutex);
+      }
+      if(!chunk->done) {
+        // everything claimed has been written
+        pthread_mutex_unlock(&ps.mutex);
+        break;
+      }
+      
+      // gather every finished chunk that is next in line into one writev
+      count = 0;
+      failed = 0;
+      while(count < ps.slot_count) {
+        chunk = &ps.slots[(ps.written_chunk + count) % ps.slot_count];
+        if(!chunk->done) {
+          break;
+        }
+        iov[count].iov_base = chunk->out->data;
+        iov[count].iov_len = chunk->out->length;
+        failed |= chunk->error;
+        count++;
+      }
+      pthread_mutex_unlock(&ps.mutex);
+      
+      if(rc == 0 && (failed || output_buffer_writev(STDOUT_FILENO, iov, count) != 0)) {
+        fprintf(stderr, "Error writing output\n");
+        rc = -1;
+      }
+      
+      pthread_mutex_lock(&ps.mutex);
+      for(i = 0; i < count; i++) {
+        ps.slots[(ps.written_chunk + i) % ps.slot_count].done = 0;
+      }
+      ps.written_chunk += count;
+      pthread_cond_broadcast(&ps.cond);
+      pthread_mutex_unlock(&ps.mutex);
+    }
+  }
+  
+  for(i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  if(started > 0) {
+    src->current = src->buffer + src->length;
+  }
+  
+  for(i = 0; i < ps.slot_count; i++) {
+    output_buffer_destroy(ps.slots[i].out);
+  }
+  free(ps.slots);
+  pthread_cond_destroy(&ps.cond);
+  pthread_mutex_destroy(&ps.mutex);
+  
+  return rc;
+}
+
+void usage(char *command_line)
+{
+  printf("freematics csv to json converter\n");
+  printf("Usage: %s <options> [input file], where options are:\n", command_line);
+  printf("  -i <mode> -- input mode: auto, buffered, mmap, readahead, uring (default: auto)\n");
+  printf("  -j <threads> -- conversion threads, mapped input files only (default: 1)\n");
+  printf("  -o <format> -- output format: json, cbor (length framed), columns (default: json)\n");
+  printf("  -z <codec> -- column block codec: delta, gorilla (default: gorilla)\n");
+  printf("  -a <window> -- summarise pids over time_delta windows of this size, disables -j\n");
+  printf("  -b <threshold>[%%] -- drop pid samples within threshold of the last one written, disables -j\n");
+  printf("  -k <interval> -- with -b, write every pid at least this often in time_delta, 0 for never (default: 10000)\n");
+  printf("  -m -- merge consecutive records sharing a time_delta into one, json only, disables -j\n");
+  printf("  -n -- decode GPS coordinates to decimal degrees and measurements to numbers\n");
+  printf("  -q <file> -- append GPS sentences failing their checksum to file instead of dropping them\n");
+  printf("  -s <file> -- keep the input offset converted so far in file and resume from it, disables -j\n");
+  printf("  -S <seconds> -- with -s, how often the offset is saved, SIGUSR1 saves it now (default: 10)\n");
+  printf("  -r <from>:<to> -- only lines with time_delta in this range, either end may be empty or a\n");
+  printf("                    gps time as YYYYMMDDTHHMMSS (needs -x), disables -j\n");
+  printf("  -x <file> -- time index built by csv_index, -r starts reading close to <from>\n");
+  printf("  reads stdin when no input file is given\n");
+  exit(-1);
+}
+
+struct config_str {
+  char    *input_file;
+  int     input_mode;
+  int     threads;
+  char    *quarantine_file;
+  int     numeric;
+  int     output_format;
+  int     column_codec;
+  long    aggregate_window;
+  int     deadband;
+  double  deadband_absolute;
+  double  deadband_relative;
+  long    deadband_keyframe;
+  int     merge;
+  char    *checkpoint_file;
+  int     checkpoint_interval;
+  char    *range;
+  char    *index_file;
+};
+
+struct config_str *config_base(void)
+{
+  struct config_str *config = (struct config_str *)calloc(1, sizeof(struct config_str));
+  if(config) {
+    config->input_file = NULL;
+    config->input_mode = DS_MODE_AUTO;
+    config->threads = 1;
+    config->quarantine_file = NULL;
+    config->numeric = 0;
+    config->output_format = OUTPUT_JSON;
+    config->column_codec = COLUMN_CODEC_GORILLA;
+    config->aggregate_window = 0;
+    config->deadband = 0;
+    config->deadband_absolute = 0;
+    config->deadband_relative = 0;
+    config->deadband_keyframe = 10000;
+    config->merge = 0;
+    config->checkpoint_file = NULL;
+    config->checkpoint_interval = 10;
+    config->range = NULL;
+    config->index_file = NULL;
+  }
+  return config;
+}
+
+void config_free(struct config_str *config)
+{
+  if(config) {
+    if(config->input_file) {
+      free(config->input_file);
+    }
+    if(config->quarantine_file) {
+      free(config->quarantine_file);
+    }
+    if(config->checkpoint_file) {
+      free(config->checkpoint_file);
+    }
+    if(config->range) {
+      free(config->range);
+    }
+    if(config->index_file) {
+      free(config->index_file);
+    }
+    free(config);
+  }
+}
+
+struct config_str *parse_command_line(int argc, char **argv)
+{
+  char *options = "a:b:i:j:k:mno:q:r:s:S:x:z:?";
+  double threshold;
+  int c, len, relative;
+  
+  struct config_str *config = config_base();
+  if(config) {
+    while((c = getopt(argc, argv, options)) != -1) {
+      switch(c) {
+        case 'a':
+          config->aggregate_window = atol(optarg);
+          if(config->aggregate_window <= 0) {
+            goto bugout;
+          }
+          break;
+        case 'b':
+          len = strlen(optarg);
+          relative = len > 0 && optarg[len - 1] == '%';
+          if(numeric_parse(optarg, len - relative, &threshold) != 0 || threshold < 0) {
+            goto bugout;
+          }
+          config->deadband = 1;
+          if(relative) {
+            config->deadband_relative = threshold / 100;
+          } else {
+            config->deadband_absolute = threshold;
+          }
+          break;
+        case 'k':
+          config->deadband_keyframe = atol(optarg);
+          if(config->deadband_keyframe < 0) {
+            goto bugout;
+          }
+          break;
+        case 'm':
+          config->merge = 1;
+          break;
+        case 'r':
+          if(!strchr(optarg, ':')) {
+            goto bugout;
+          }
+          config->range = strdup(optarg);
+          break;
+        case 's':
+          config->checkpoint_file = strdup(optarg);
+          break;
+        case 'x':
+          config->index_file = strdup(optarg);
+          break;
+        case 'S':
+          config->checkpoint_interval = atoi(optarg);
+          if(config->checkpoint_interval < 0) {
+            goto bugout;
+          }
+          break;
+        case 'i':
+          config->input_mode = ds_mode_from_string(optarg);
+          if(config->input_mode < 0) {
+            goto bugout;
+          }
+          break;
+        case 'j':
+          config->threads = atoi(optarg);
+          if(config->threads <= 0 || config->threads > MAX_THREADS) {
+            goto bugout;
+          }
+          break;
+        case 'n':
+          config->numeric = 1;
+          break;
+        case 'o':
+          if(strcmp(optarg, "json") == 0) {
+            config->output_format = OUTPUT_JSON;
+          } else if(strcmp(optarg, "cbor") == 0) {
+            config->output_format = OUTPUT_CBOR;
+          } else if(strcmp(optarg, "columns") == 0) {
+            config->output_format = OUTPUT_COLUMNS;
+          } else {
+            goto bugout;
+          }
+          break;
+        case 'z':
+          config->column_codec = column_codec_from_string(optarg);
+          if(config->column_codec < 0) {
+            goto bugout;
+          }
+          break;
+        case 'q':
+          config->quarantine_file = strdup(optarg);
+          break;
+        case '?':
+          goto bugout;
+      }
+    }
+    // windows are summaries, the column store wants every sample
+    if(config->aggregate_window > 0 && config->output_format == OUTPUT_COLUMNS) {
+      goto bugout;
+    }
+    // merged records are json, and windows are written apart from them
+    if(config->merge && (config->output_format != OUTPUT_JSON || config->aggregate_window > 0)) {
+      goto bugout;
+    }
+    // a checkpoint needs everything before it written, open windows and
+    // column blocks are only complete at the end
+    if(config->checkpoint_file && 
+       (config->aggregate_window > 0 || config->output_format == OUTPUT_COLUMNS)) {
+      goto bugout;
+    }
+    // both pick where reading starts
+    if(config->checkpoint_file && config->range) {
+      goto bugout;
+    }
+    if(optind < argc) {
+      config->input_file = strdup(argv[optind]);
+    }
+  }
+
+  if(0) {
+bugout:
+    if(config) {
+      config_free(config);
+      config = NULL;
+    }
+    usage(argv[0]);
+  }  
+  
+  return config;
+}
+
+// One end of -r, a time_delta or a gps time (YYYYMMDDTHHMMSS) looked up 
+// through the index anchors.  Empty ends are left as they are.
+int parse_range_bound(char *s, int len, time_index_t *index, long long *time_delta)
+{
+  static const int at[] = { 0, 4, 6, 9, 11, 13, 15 };
+  int64_t utc_ms, t;
+  double value;
+  int i, j, v[6];
+  
+  if(len == 0) {
+    return 0;
+  }
+  if(len == 15 && s[8] == 'T') {
+    for(i = 0; i < 6; i++) {
+      v[i] = 0;
+      for(j = at[i]; j < at[i + 1] && j != 8; j++) {
+        if(!isdigit(s[j])) {
+          return -1;
+        }
+        v[i] = v[i] * 10 + (s[j] - '0');
+      }
+    }
+    utc_ms = time_index_utc_ms(v[0], v[1], v[2], v[3], v[4], v[5], 0);
+    if(!index || time_index_utc_to_time_delta(index, utc_ms, &t) != 0) {
+      return -1;
+    }
+    *time_delta = t;
+    return 0;
+  }
+  if(numeric_parse(s, len, &value) != 0) {
+    return -1;
+  }
+  *time_delta = (long long)value;
+  
+  return 0;
+}
+
+// time_delta of a stanza, -1 when it doesn't start with one
+int stanza_time(stanza_t *stanza, long long *time_delta)
+{
+  char *field;
+  int len;
+  
+  field = stanza_field(stanza, 0, &len);
+  return ds_line_time(field, field + len, time_delta);
+}
+
+// Everything converted so far is written out before its offset is saved,
+// a pending merged record is cut short at the checkpoint.
+int save_checkpoint(checkpoint_t *checkpoint, ds_source_state_t *src, output_buffer_t *out)
+{
+  if(merge && merge_flush(out) < 0) {
+    return -1;
+  }
+  if(output_buffer_flush(out) != 0) {
+    return -1;
+  }
+  if(quarantine_file) {
+    fflush(quarantine_file);
+  }
+  return checkpoint_save(checkpoint, ds_tell(src));
+}
+
+int main(int argc, char **argv)
+{
+  checkpoint_t *checkpoint = NULL;
+  time_index_t *index = NULL;
+  long long resume, range_from = LLONG_MIN, range_to = LLONG_MAX, time_delta;
+  long stanzas = 0;
+  int n, rc = 0, range_ordered = 0;
+  char *sep;
+  
+  struct config_str *config = parse_command_line(argc, argv);
+  if(config == NULL) {
+    usage(argv[0]);
+  }
+  
+  numeric_output = config->numeric;
+  output_format = config->output_format;
+  aggregate_window = config->aggregate_window;
+  deadband = config->deadband;
+  deadband_absolute = config->deadband_absolute;
+  deadband_relative = config->deadband_relative;
+  deadband_keyframe = config->deadband_keyframe;
+  if(deadband) {
+    deadband_init();
+  }
+  if(config->merge) {
+    merge = merge_create();
+    if(merge == NULL) {
+      fprintf(stderr, "Unable to allocate merge buffers\n");
+      exit(-1);
+    }
+  }
+  gps_templates = generate_gps_templates();
+  line_scan_init();
+  
+  if(config->quarantine_file) {
+    quarantine_file = fopen(config->quarantine_file, "a");
+    if(quarantine_file == NULL) {
+      fprintf(stderr, "Unable to open quarantine file: %s\n", config->quarantine_file);
+      exit(-1);
+    }
+  }
+  
+  stanza_t *stanza = calloc(1, sizeof(stanza_t));
+  ds_source_state_t *src = ds_open_file_mode(config->input_file, BUFFER_LENGTH, config->input_mode);
+  if(src == NULL) {
+    fprintf(stderr, "Unable to open input: %s\n", config->input_file ? config->input_file : "stdin");
+    exit(-1);
+  }
+  
+  if(config->checkpoint_file) {
+    checkpoint = checkpoint_open(config->checkpoint_file, src->infile, 
+                                 config->checkpoint_interval, &resume);
+    if(checkpoint == NULL) {
+      fprintf(stderr, "Unable to use checkpoint: %s\n", config->checkpoint_file);
+      exit(-1);
+    }
+    if(resume > 0 && ds_seek(src, resume) != 0) {
+      fprintf(stderr, "Unable to resume input at offset %lld\n", resume);
+      exit(-1);
+    }
+  }
+  
+  if(config->index_file) {
+    index = time_index_open(config->index_file);
+    if(index == NULL) {
+      fprintf(stderr, "Unable to open time index: %s\n", config->index_file);
+      exit(-1);
+    }
+    if(!src->infile || time_index_check(index, fileno(src->infile)) != 0) {
+      fprintf(stderr, "Time index %s was not built from this input\n", config->index_file);
+      exit(-1);
+    }
+  }
+  if(config->range) {
+    sep = strchr(config->range, ':');
+    if(parse_range_bound(config->range, sep - config->range, index, &range_from) != 0 ||
+       parse_range_bound(sep + 1, strlen(sep + 1), index, &range_to) != 0) {
+      fprintf(stderr, "Unable to resolve range: %s\n", config->range);
+      exit(-1);
+    }
+    // past <to> nothing more matches when the index vouches for the order
+    range_ordered = index && index->header->monotonic;
+    if(range_from != LLONG_MIN && ds_seek_time(src, index, range_from) != 0) {
+      fprintf(stderr, "Unable to seek input to time_delta %lld\n", range_from);
+      exit(-1);
+    }
+  }
+  
+  if(output_format == OUTPUT_COLUMNS) {
+    memset(pid_columns, 0xff, sizeof(pid_columns));
+    column_output = column_writer_create(STDOUT_FILENO, config->column_codec);
+    if(column_output == NULL) {
+      fprintf(stderr, "Unable to create column output\n");
+      exit(-1);
+    }
+  }
+  
+  // chunking needs the whole input in memory, columns, windows, the 
+  // deadband, merged records and checkpoints are built in input order
+  if(config->threads > 1 && src->mode == DS_MODE_MMAP && output_format != OUTPUT_COLUMNS &&
+     aggregate_window == 0 && !deadband && !merge && !checkpoint && !config->range) {
+    rc = convert_parallel(src, config->threads);
+  }
+  
+  output_buffer_t *out = output_buffer_create(OUTPUT_LENGTH, STDOUT_FILENO);
+  while((n = read_stanza(src, stanza)) > 0) {
+    if(config->range && stanza_time(stanza, &time_delta) == 0 &&
+       (time_delta < range_from || time_delta > range_to)) {
+      if(time_delta > range_to && range_ordered) {
+        break;
+      }
+      continue;
+    }
+    if(parse_stanza(stanza, out) < 0) {
+      fprintf(stderr, "Error writing output\n");
+      rc = -1;
+      break;
+    }
+    if(checkpoint && (++stanzas % CHECKPOINT_STANZAS) == 0 && checkpoint_due(checkpoint)) {
+      if(save_checkpoint(checkpoint, src, out) != 0) {
+        fprintf(stderr, "Unable to save checkpoint: %s\n", config->checkpoint_file);
+      }
+      if(checkpoint_exit_requested) {
+        break;
+      }
+    }
+  }
+  if(n < 0) {
+    fprintf(stderr, "Error reading input\n");
+    rc = -1;
+  }
+  if(aggregate_window > 0 && flush_aggregates(out) < 0) {
+    fprintf(stderr, "Error writing output\n");
+    rc = -1;
+  }
+  if(merge && merge_flush(out) < 0) {
+    fprintf(stderr, "Error writing output\n");
+    rc = -1;
+  }
+  if(checkpoint && rc == 0 && save_checkpoint(checkpoint, src, out) != 0) {
+    fprintf(stderr, "Unable to save checkpoint: %s\n", config->checkpoint_file);
+  }
+  if(output_buffer_flush(out) != 0) {
+    fprintf(stderr, "Error writing output\n");
+    rc = -1;
+  }
+  output_buffer_destroy(out);
+  checkpoint_close(checkpoint);
+  time_index_close(index);
+  if(column_output && column_writer_close(column_output) != 0) {
+    fprintf(stderr, "Error writing output\n");
+    rc = -1;
+  }
+  report_gps_stats();
+  if(quarantine_file) {
+    fclose(quarantine_file);
+  }
+  ds_close_file(src);
+  delete_stanza(stanza);
+  config_free(config);
+  
+  return rc;
+}
@@ -1,36 +1,865 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef DS_WITH_IO_URING
+#include <errno.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <liburing.h>
+#endif
+
+#ifdef DS_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DS_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #include "data_stream.h"
+#include "time_index.h"
+
+#define DS_READAHEAD_SLOTS 2
+
+// produces up to len bytes into buf, sets eof once the source is drained
+typedef long (*ds_fill_handler)(ds_source_state_t *src, char *buf, long len, int *eof);
+
+typedef struct ds_readahead_slot_str {
+  char *base;       // headroom followed by max_buffer bytes of data
+  long length;
+  int  filled;
+  int  eof;
+  int  error;
+} ds_readahead_slot_t;
+
+// Two buffers are swapped between the reader thread and the parser.  Each 
+// one has headroom in front of the data so the unparsed tail of the old 
+// buffer can be placed right before the new data instead of compacting.
+typedef struct ds_readahead_str {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  
+  ds_readahead_slot_t slots[DS_READAHEAD_SLOTS];
+  int  fill_idx;    // next slot for the reader thread
+  int  use_idx;     // slot the parser is walking, -1 before the first load
+  int  headroom;
+  int  stop;
+  
+  ds_fill_handler fill;
+} ds_readahead_t;
+
+// Map the whole file.  The mapping is private and writable because the 
+// readers terminate lines in place; touched pages are copied on write and
+// never make it back to the file.
+static int ds_map_file(ds_source_state_t *src)
+{
+  struct stat st;
+  char *map;
+  long pagesize;
+  
+  if(fstat(fileno(src->infile), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  
+  // empty files can't be mapped and files over the address space can't either
+  if(st.st_size <= 0 || (off_t)(long)st.st_size != st.st_size) {
+    return -1;
+  }
+  
+  // the last line is only terminated by the zero fill at the end of the 
+  // final page, if the file ends exactly on a page without a newline let 
+  // the buffered path deal with it
+  pagesize = sysconf(_SC_PAGESIZE);
+  if(pagesize > 0 && (st.st_size % pagesize) == 0) {
+    char last;
+    if(pread(fileno(src->infile), &last, 1, st.st_size - 1) != 1 ||
+       (last != '\n' && last != '\r')) {
+      return -1;
+    }
+  }
+  
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(src->infile), 0);
+  if(map == MAP_FAILED) {
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  
+  src->buffer = map;
+  src->current = map;
+  src->length = st.st_size;
+  src->eof = 1;
+  src->mode = DS_MODE_MMAP;
+  
+  return 0;
+}
+
+static long ds_fill_fread(ds_source_state_t *src, char *buf, long len, int *eof)
+{
+  long n = 0;
+  
+  // hand out anything read while sniffing the input first
+  if(src->pending_length > 0) {
+    n = src->pending_length < len ? src->pending_length : len;
+    memcpy(buf, src->pending, n);
+    memmove(src->pending, src->pending + n, src->pending_length - n);
+    src->pending_length -= n;
+    if(n == len) {
+      return n;
+    }
+  }
+  
+  n += fread(buf + n, sizeof(char), len - n, src->infile);
+  if(n < len) {
+    if(feof(src->infile)) {
+      *eof = 1;
+    } else if(ferror(src->infile)) {
+      n = -1;
+    }
+  }
+  return n;
+}
+
+static void *ds_readahead_thread(void *arg)
+{
+  ds_source_state_t *src = (ds_source_state_t *)arg;
+  ds_readahead_t *ra = src->readahead;
+  ds_readahead_slot_t *slot;
+  long n;
+  int eof;
+  
+  while(1) {
+    pthread_mutex_lock(&ra->mutex);
+    slot = &ra->slots[ra->fill_idx];
+    while(slot->filled && !ra->stop) {
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    }
+    if(ra->stop) {
+      pthread_mutex_unlock(&ra->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&ra->mutex);
+    
+    eof = 0;
+    n = (*ra->fill)(src, slot->base + ra->headroom, src->max_buffer, &eof);
+    
+    // keep a terminator after the data for an unterminated last line
+    slot->base[ra->headroom + (n < 0 ? 0 : n)] = 0;
+    
+    pthread_mutex_lock(&ra->mutex);
+    slot->length = n < 0 ? 0 : n;
+    slot->error = n < 0;
+    slot->eof = eof;
+    slot->filled = 1;
+    ra->fill_idx = (ra->fill_idx + 1) % DS_READAHEAD_SLOTS;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    
+    if(eof || n < 0) {
+      break;
+    }
+  }
+  
+  return NULL;
+}
+
+static void ds_readahead_stop(ds_source_state_t *src)
+{
+  ds_readahead_t *ra = src->readahead;
+  int i;
+  
+  pthread_mutex_lock(&ra->mutex);
+  ra->stop = 1;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+  pthread_join(ra->thread, NULL);
+  
+  for(i = 0; i < DS_READAHEAD_SLOTS; i++) {
+    free(ra->slots[i].base);
+  }
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->mutex);
+  free(ra);
+  src->readahead = NULL;
+}
+
+static int ds_readahead_start(ds_source_state_t *src, ds_fill_handler fill)
+{
+  ds_readahead_t *ra = (ds_readahead_t *)calloc(1, sizeof(ds_readahead_t));
+  int i;
+  
+  if(!ra) {
+    return -1;
+  }
+  
+  // read_stanza and next_message reload with less than max_buffer / 8 
+  // left, so a full buffer of headroom always fits the carried tail
+  ra->headroom = src->max_buffer;
+  ra->use_idx = -1;
+  ra->fill = fill;
+  for(i = 0; i < DS_READAHEAD_SLOTS; i++) {
+    ra->slots[i].base = (char *)calloc(ra->headroom + src->max_buffer + 1, sizeof(char));
+    if(!ra->slots[i].base) {
+      while(i-- > 0) {
+        free(ra->slots[i].base);
+      }
+      free(ra);
+      return -1;
+    }
+  }
+  pthread_mutex_init(&ra->mutex, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  
+  src->readahead = ra;
+  if(pthread_create(&ra->thread, NULL, ds_readahead_thread, src) != 0) {
+    for(i = 0; i < DS_READAHEAD_SLOTS; i++) {
+      free(ra->slots[i].base);
+    }
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    free(ra);
+    src->readahead = NULL;
+    return -1;
+  }
+  src->mode = DS_MODE_READAHEAD;
+  
+  return 0;
+}
+
+// swap in the next filled buffer, carrying over whatever is left unparsed
+static int ds_readahead_load(ds_source_state_t *src)
+{
+  ds_readahead_t *ra = src->readahead;
+  ds_readahead_slot_t *slot;
+  long tail = 0;
+  int next;
+  char *dest;
+  
+  if(src->buffer) {
+    tail = src->length - (src->current - src->buffer);
+  }
+  if(tail > ra->headroom) {
+    return -1;
+  }
+  
+  next = (ra->use_idx + 1) % DS_READAHEAD_SLOTS;
+  slot = &ra->slots[next];
+  pthread_mutex_lock(&ra->mutex);
+  while(!slot->filled) {
+    pthread_cond_wait(&ra->cond, &ra->mutex);
+  }
+  pthread_mutex_unlock(&ra->mutex);
+  
+  if(slot->error) {
+    return -1;
+  }
+  
+  dest = slot->base + ra->headroom - tail;
+  if(tail > 0) {
+    memcpy(dest, src->current, tail);
+  }
+  if(src->buffer) {
+    src->base_offset += src->current - src->buffer;
+  }
+  src->buffer = dest;
+  src->current = dest;
+  src->length = tail + slot->length;
+  src->eof = slot->eof;
+  
+  // hand the old buffer back to the reader thread
+  if(ra->use_idx >= 0) {
+    pthread_mutex_lock(&ra->mutex);
+    ra->slots[ra->use_idx].filled = 0;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+  }
+  ra->use_idx = next;
+  
+  return slot->length;
+}
+
+#ifdef DS_WITH_IO_URING
+
+#define DS_URING_DEPTH  8
+#define DS_URING_CHUNK  (64 * 1024)
+
+typedef enum {
+  DS_URING_IDLE = 0,    // nothing queued, past the end of the file
+  DS_URING_IN_FLIGHT,
+  DS_URING_DONE
+} ds_uring_buffer_state_t;
+
+// A ring of registered buffers kept queued with fixed reads against the 
+// file.  Buffers are handed to the parser in file order, with the same 
+// headroom scheme as read-ahead for carrying the unparsed tail.
+typedef struct ds_uring_str {
+  struct io_uring ring;
+  struct iovec iov[DS_URING_DEPTH];
+  ds_uring_buffer_state_t state[DS_URING_DEPTH];
+  off_t offset[DS_URING_DEPTH];     // file offset of the buffer's data
+  long  want[DS_URING_DEPTH];       // bytes requested
+  long  have[DS_URING_DEPTH];       // bytes completed
+  int   error[DS_URING_DEPTH];
+  
+  int   fd;
+  off_t file_size;
+  off_t submit_offset;  // where the next fresh read starts
+  long  chunk;
+  long  headroom;
+  int   use_idx;        // buffer the parser is walking, -1 before the first load
+  int   next_idx;       // next buffer in file order
+  int   unsubmitted;    // prepared but not yet submitted reads
+} ds_uring_t;
+
+static int ds_uring_prep(ds_uring_t *ur, int idx)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ur->ring);
+  if(!sqe) {
+    io_uring_submit(&ur->ring);
+    ur->unsubmitted = 0;
+    sqe = io_uring_get_sqe(&ur->ring);
+    if(!sqe) {
+      return -1;
+    }
+  }
+  
+  io_uring_prep_read_fixed(sqe, ur->fd, 
+                           (char *)ur->iov[idx].iov_base + ur->headroom + ur->have[idx],
+                           ur->want[idx] - ur->have[idx], 
+                           ur->offset[idx] + ur->have[idx], idx);
+  io_uring_sqe_set_data(sqe, (void *)(intptr_t)idx);
+  ur->state[idx] = DS_URING_IN_FLIGHT;
+  ur->unsubmitted++;
+  
+  return 0;
+}
+
+// queue the next chunk of the file into a free buffer
+static int ds_uring_queue(ds_uring_t *ur, int idx)
+{
+  if(ur->submit_offset >= ur->file_size) {
+    ur->state[idx] = DS_URING_IDLE;
+    return 0;
+  }
+  
+  ur->offset[idx] = ur->submit_offset;
+  ur->want[idx] = ur->file_size - ur->submit_offset;
+  if(ur->want[idx] > ur->chunk) {
+    ur->want[idx] = ur->chunk;
+  }
+  ur->have[idx] = 0;
+  ur->error[idx] = 0;
+  ur->submit_offset += ur->want[idx];
+  
+  return ds_uring_prep(ur, idx);
+}
+
+// submit anything outstanding and reap at least one completion
+static int ds_uring_reap(ds_uring_t *ur)
+{
+  struct io_uring_cqe *cqe;
+  int rc, idx;
+  
+  do {
+    if(ur->unsubmitted) {
+      rc = io_uring_submit_and_wait(&ur->ring, 1);
+      if(rc >= 0) {
+        ur->unsubmitted = 0;
+      }
+    } else {
+      rc = io_uring_wait_cqe(&ur->ring, &cqe);
+    }
+  } while(rc == -EINTR);
+  if(rc < 0) {
+    return -1;
+  }
+  
+  while(io_uring_peek_cqe(&ur->ring, &cqe) == 0) {
+    idx = (int)(intptr_t)io_uring_cqe_get_data(cqe);
+    rc = cqe->res;
+    io_uring_cqe_seen(&ur->ring, cqe);
+    
+    if(rc == -EAGAIN || rc == -EINTR) {
+      ds_uring_prep(ur, idx);
+    } else if(rc < 0) {
+      ur->error[idx] = 1;
+      ur->state[idx] = DS_URING_DONE;
+    } else {
+      ur->have[idx] += rc;
+      // short reads on a regular file get the remainder requeued, a zero 
+      // length read means the file shrank underneath us
+      if(rc > 0 && ur->have[idx] < ur->want[idx]) {
+        ds_uring_prep(ur, idx);
+      } else {
+        ur->state[idx] = DS_URING_DONE;
+      }
+    }
+  }
+  
+  return 0;
+}
+
+static void ds_uring_stop(ds_source_state_t *src)
+{
+  ds_uring_t *ur = src->uring;
+  int i, in_flight;
+  
+  // the kernel may still be writing into the buffers, drain before freeing
+  do {
+    in_flight = 0;
+    for(i = 0; i < DS_URING_DEPTH; i++) {
+      if(ur->state[i] == DS_URING_IN_FLIGHT) {
+        in_flight = 1;
+      }
+    }
+  } while(in_flight && ds_uring_reap(ur) == 0);
+  
+  io_uring_queue_exit(&ur->ring);
+  for(i = 0; i < DS_URING_DEPTH; i++) {
+    free(ur->iov[i].iov_base);
+  }
+  free(ur);
+  src->uring = NULL;
+}
+
+static int ds_uring_start(ds_source_state_t *src)
+{
+  ds_uring_t *ur;
+  struct stat st;
+  int i;
+  
+  if(fstat(fileno(src->infile), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  
+  ur = (ds_uring_t *)calloc(1, sizeof(ds_uring_t));
+  if(!ur) {
+    return -1;
+  }
+  ur->fd = fileno(src->infile);
+  ur->file_size = st.st_size;
+  ur->chunk = src->max_buffer > DS_URING_CHUNK ? src->max_buffer : DS_URING_CHUNK;
+  ur->headroom = src->max_buffer;
+  ur->use_idx = -1;
+  // after ds_seek the reads start where the stream was moved to
+  ur->submit_offset = ftello(src->infile);
+  if(ur->submit_offset < 0) {
+    ur->submit_offset = 0;
+  }
+  
+  if(io_uring_queue_init(DS_URING_DEPTH * 2, &ur->ring, 0) < 0) {
+    free(ur);
+    return -1;
+  }
+  
+  for(i = 0; i < DS_URING_DEPTH; i++) {
+    ur->iov[i].iov_len = ur->headroom + ur->chunk + 1;
+    if(posix_memalign(&ur->iov[i].iov_base, sysconf(_SC_PAGESIZE), ur->iov[i].iov_len) != 0) {
+      ur->iov[i].iov_base = NULL;
+      break;
+    }
+  }
+  if(i < DS_URING_DEPTH || 
+     io_uring_register_buffers(&ur->ring, ur->iov, DS_URING_DEPTH) != 0) {
+    io_uring_queue_exit(&ur->ring);
+    for(i = 0; i < DS_URING_DEPTH; i++) {
+      free(ur->iov[i].iov_base);
+    }
+    free(ur);
+    return -1;
+  }
+  
+  // fill the whole queue with a single submission
+  src->uring = ur;
+  for(i = 0; i < DS_URING_DEPTH; i++) {
+    ds_uring_queue(ur, i);
+  }
+  io_uring_submit(&ur->ring);
+  ur->unsubmitted = 0;
+  src->mode = DS_MODE_URING;
+  
+  return 0;
+}
+
+static int ds_uring_load(ds_source_state_t *src)
+{
+  ds_uring_t *ur = src->uring;
+  long tail = 0;
+  int idx = ur->next_idx;
+  char *dest;
+  
+  if(src->buffer) {
+    tail = src->length - (src->current - src->buffer);
+  }
+  if(tail > ur->headroom) {
+    return -1;
+  }
+  
+  while(ur->state[idx] == DS_URING_IN_FLIGHT) {
+    if(ds_uring_reap(ur) < 0) {
+      return -1;
+    }
+  }
+  if(ur->error[idx]) {
+    return -1;
+  }
+  
+  if(ur->state[idx] == DS_URING_IDLE) {
+    // nothing more was queued, the file is done
+    src->eof = 1;
+    return 0;
+  }
+  
+  dest = (char *)ur->iov[idx].iov_base + ur->headroom - tail;
+  if(tail > 0) {
+    memcpy(dest, src->current, tail);
+  }
+  dest[tail + ur->have[idx]] = 0;
+  if(src->buffer) {
+    src->base_offset += src->current - src->buffer;
+  }
+  src->buffer = dest;
+  src->current = dest;
+  src->length = tail + ur->have[idx];
+  if(ur->offset[idx] + ur->have[idx] >= ur->file_size || ur->have[idx] < ur->want[idx]) {
+    src->eof = 1;
+  }
+  
+  // requeue the buffer we just left, submitting in batches
+  if(ur->use_idx >= 0) {
+    ds_uring_queue(ur, ur->use_idx);
+    if(ur->unsubmitted >= DS_URING_DEPTH / 2) {
+      io_uring_submit(&ur->ring);
+      ur->unsubmitted = 0;
+    }
+  }
+  ur->use_idx = idx;
+  ur->next_idx = (idx + 1) % DS_URING_DEPTH;
+  
+  return ur->have[idx];
+}
+
+#endif /* DS_WITH_IO_URING */
+
+#define DS_DECOMPRESS_INPUT (64 * 1024)
+
+// Compressed input is read in large blocks and inflated by the read-ahead
+// thread straight into the buffer the parser walks next.
+typedef struct ds_decompress_str {
+  char *input;
+  long input_length;
+  int  input_eof;
+  int  open;              // inside a gzip member or zstd frame
+#ifdef DS_WITH_ZLIB
+  z_stream zs;
+#endif
+#ifdef DS_WITH_ZSTD
+  ZSTD_DStream *zds;
+  ZSTD_inBuffer zin;
+#endif
+} ds_decompress_t;
+
+#if defined(DS_WITH_ZLIB) || defined(DS_WITH_ZSTD)
+// refill the compressed input once it has all been consumed
+static int ds_decompress_input(ds_source_state_t *src)
+{
+  ds_decompress_t *dc = src->decompress;
+  
+  dc->input_length = ds_fill_fread(src, dc->input, DS_DECOMPRESS_INPUT, &dc->input_eof);
+  if(dc->input_length < 0) {
+    dc->input_length = 0;
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+#ifdef DS_WITH_ZLIB
+static long ds_fill_gzip(ds_source_state_t *src, char *buf, long len, int *eof)
+{
+  ds_decompress_t *dc = src->decompress;
+  uInt avail_out;
+  int rc;
+  
+  dc->zs.next_out = (Bytef *)buf;
+  dc->zs.avail_out = len;
+  while(dc->zs.avail_out > 0) {
+    if(dc->zs.avail_in == 0 && !dc->input_eof) {
+      if(ds_decompress_input(src) != 0) {
+        return -1;
+      }
+      dc->zs.next_in = (Bytef *)dc->input;
+      dc->zs.avail_in = dc->input_length;
+      continue;
+    }
+    if(dc->zs.avail_in == 0 && !dc->open) {
+      *eof = 1;
+      break;
+    }
+    
+    avail_out = dc->zs.avail_out;
+    rc = inflate(&dc->zs, Z_NO_FLUSH);
+    dc->open = 1;
+    if(rc == Z_STREAM_END) {
+      // concatenated members (as written by appending gzip runs) follow on
+      inflateReset(&dc->zs);
+      dc->open = 0;
+    } else if(rc != Z_OK && rc != Z_BUF_ERROR) {
+      return -1;
+    } else if(dc->zs.avail_in == 0 && dc->input_eof && dc->zs.avail_out == avail_out) {
+      // the input ends inside a member
+      return -1;
+    }
+  }
+  
+  return len - dc->zs.avail_out;
+}
+#endif
+
+#ifdef DS_WITH_ZSTD
+static long ds_fill_zstd(ds_source_state_t *src, char *buf, long len, int *eof)
+{
+  ds_decompress_t *dc = src->decompress;
+  ZSTD_outBuffer zout = { buf, len, 0 };
+  size_t rc, pos;
+  
+  while(zout.pos < zout.size) {
+    if(dc->zin.pos == dc->zin.size && !dc->input_eof) {
+      if(ds_decompress_input(src) != 0) {
+        return -1;
+      }
+      dc->zin.src = dc->input;
+      dc->zin.size = dc->input_length;
+      dc->zin.pos = 0;
+      continue;
+    }
+    if(dc->zin.pos == dc->zin.size && !dc->open) {
+      *eof = 1;
+      break;
+    }
+    
+    pos = zout.pos;
+    rc = ZSTD_decompressStream(dc->zds, &zout, &dc->zin);
+    if(ZSTD_isError(rc)) {
+      return -1;
+    }
+    // 0 once a frame is decoded and flushed
+    dc->open = rc != 0;
+    if(dc->open && dc->zin.pos == dc->zin.size && dc->input_eof && zout.pos == pos) {
+      // the input ends inside a frame
+      return -1;
+    }
+  }
+  
+  return zout.pos;
+}
+#endif
+
+static void ds_decompress_free(ds_source_state_t *src)
+{
+  ds_decompress_t *dc = src->decompress;
+  
+  if(dc) {
+#ifdef DS_WITH_ZLIB
+    if(src->compression == DS_COMPRESSION_GZIP) {
+      inflateEnd(&dc->zs);
+    }
+#endif
+#ifdef DS_WITH_ZSTD
+    if(dc->zds) {
+      ZSTD_freeDStream(dc->zds);
+    }
+#endif
+    free(dc->input);
+    free(dc);
+    src->decompress = NULL;
+  }
+}
+
+// Look at the first bytes of the input for a gzip or zstd header.  Regular
+// files are peeked at without moving the stream, anything else keeps the
+// sniffed bytes in src->pending.
+static ds_compression_t ds_sniff_compression(ds_source_state_t *src)
+{
+  unsigned char magic[4];
+  struct stat st;
+  long n;
+  
+  if(fstat(fileno(src->infile), &st) == 0 && S_ISREG(st.st_mode)) {
+    n = pread(fileno(src->infile), magic, sizeof(magic), 0);
+  } else {
+    n = fread(src->pending, sizeof(char), sizeof(src->pending), src->infile);
+    memcpy(magic, src->pending, n > 0 ? n : 0);
+    src->pending_length = n > 0 ? n : 0;
+  }
+  
+  if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return DS_COMPRESSION_GZIP;
+  }
+  if(n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+    return DS_COMPRESSION_ZSTD;
+  }
+  return DS_COMPRESSION_NONE;
+}
+
+static int ds_decompress_start(ds_source_state_t *src)
+{
+  ds_decompress_t *dc = (ds_decompress_t *)calloc(1, sizeof(ds_decompress_t));
+  ds_fill_handler fill = NULL;
+  
+  if(!dc) {
+    return -1;
+  }
+  dc->input = (char *)calloc(DS_DECOMPRESS_INPUT, sizeof(char));
+  if(!dc->input) {
+    free(dc);
+    return -1;
+  }
+  src->decompress = dc;
+  
+#ifdef DS_WITH_ZLIB
+  if(src->compression == DS_COMPRESSION_GZIP) {
+    // 15 + 32 accepts gzip and zlib headers
+    if(inflateInit2(&dc->zs, 15 + 32) != Z_OK) {
+      free(dc->input);
+      free(dc);
+      src->decompress = NULL;
+      return -1;
+    }
+    fill = ds_fill_gzip;
+  }
+#endif
+#ifdef DS_WITH_ZSTD
+  if(src->compression == DS_COMPRESSION_ZSTD) {
+    dc->zds = ZSTD_createDStream();
+    if(!dc->zds || ZSTD_isError(ZSTD_initDStream(dc->zds))) {
+      ds_decompress_free(src);
+      return -1;
+    }
+    fill = ds_fill_zstd;
+  }
+#endif
+  
+  // no decompressor compiled in for this format
+  if(!fill) {
+    ds_decompress_free(src);
+    return -1;
+  }
+  
+  if(ds_readahead_start(src, fill) != 0) {
+    ds_decompress_free(src);
+    return -1;
+  }
+  
+  return 0;
+}
+
+int ds_mode_from_string(char *name)
+{
+  if(!name) {
+    return -1;
+  }
+  if(strcmp(name, "auto") == 0) {
+    return DS_MODE_AUTO;
+  } else if(strcmp(name, "buffered") == 0) {
+    return DS_MODE_BUFFERED;
+  } else if(strcmp(name, "mmap") == 0) {
+    return DS_MODE_MMAP;
+  } else if(strcmp(name, "readahead") == 0) {
+    return DS_MODE_READAHEAD;
+  } else if(strcmp(name, "uring") == 0) {
+    return DS_MODE_URING;
+  }
+  return -1;
+}
 
 ds_source_state_t *ds_open_file(char *filename, int max_buffer)
+{
+  return ds_open_file_mode(filename, max_buffer, DS_MODE_AUTO);
+}
+
+ds_source_state_t *ds_open_file_mode(char *filename, int max_buffer, ds_mode_t mode)
 {
   ds_source_state_t *src = (ds_source_state_t *)calloc(1, sizeof(ds_source_state_t));
   src->max_buffer = max_buffer;
+  src->mode = DS_MODE_BUFFERED;
   if(filename) {
     src->infile = fopen(filename, "r");
     if(src->infile == NULL) {
       free(src);
-      src = NULL;
+      return NULL;
     }
   } else {
     src->infile = stdin;
   }
+  
+  // compressed input is always decompressed on the read-ahead thread
+  src->compression = ds_sniff_compression(src);
+  if(src->compression != DS_COMPRESSION_NONE) {
+    if(ds_decompress_start(src) != 0) {
+      ds_close_file(src);
+      return NULL;
+    }
+    return src;
+  }
+  
+  // stdin and pipes stay on the buffered path
+  if(mode == DS_MODE_AUTO || mode == DS_MODE_MMAP) {
+    ds_map_file(src);
+  } else if(mode == DS_MODE_READAHEAD) {
+    ds_readahead_start(src, ds_fill_fread);
+  } else if(mode == DS_MODE_URING) {
+#ifdef DS_WITH_IO_URING
+    // without kernel support this stays on the buffered path
+    ds_uring_start(src);
+#endif
+  }
 
   return src;  
 }
 
+// Wrap a slice of memory the caller keeps alive, e.g. a chunk of a mapped 
+// file.  The readers terminate lines in place so it must be writable.
+ds_source_state_t *ds_open_memory(char *buffer, long length, int max_buffer)
+{
+  ds_source_state_t *src = (ds_source_state_t *)calloc(1, sizeof(ds_source_state_t));
+  if(src) {
+    src->max_buffer = max_buffer;
+    src->mode = DS_MODE_MEMORY;
+    src->buffer = buffer;
+    src->current = buffer;
+    src->length = length;
+    src->eof = 1;
+  }
+  return src;
+}
+
 void ds_close_file(ds_source_state_t *src)
 {
   if(src) {
+    // the reader thread owns infile until it is stopped
+    if(src->readahead) {
+      ds_readahead_stop(src);
+      ds_decompress_free(src);
+#ifdef DS_WITH_IO_URING
+    } else if(src->uring) {
+      ds_uring_stop(src);
+#endif
+    } else if(src->buffer) {
+      if(src->mode == DS_MODE_MMAP) {
+        munmap(src->buffer, src->length);
+      } else if(src->mode != DS_MODE_MEMORY) {
+        free(src->buffer);
+      }
+    }
+    
     if(src->infile && src->infile != stdin) {
       fclose(src->infile);
     }
-  
-    if(src->buffer) {
-      free(src->buffer);
-    }
     
     free(src);
   }
@@ -41,10 +870,29 @@ int ds_load_data(ds_source_state_t *src)
   long read_offset = 0;
   long n;
   
-  if(!src || !src->infile) {
+  if(!src) {
     return -1;
   }
   
+  // the mapping or memory already holds everything
+  if(src->mode == DS_MODE_MMAP || src->mode == DS_MODE_MEMORY) {
+    return 0;
+  }
+  
+  if(!src->infile) {
+    return -1;
+  }
+  
+  if(src->mode == DS_MODE_READAHEAD) {
+    return src->eof ? 0 : ds_readahead_load(src);
+  }
+  
+#ifdef DS_WITH_IO_URING
+  if(src->mode == DS_MODE_URING) {
+    return src->eof ? 0 : ds_uring_load(src);
+  }
+#endif
+  
   if(!src->buffer) {
     src->buffer = calloc(src->max_buffer, sizeof(char));
     src->current = src->buffer;
@@ -55,23 +903,189 @@ int ds_load_data(ds_source_state_t *src)
     return 0;
   }
   
-  // need to keep what is unused
+  // need to keep what is unused, and read on behind it
   if(src->current > src->buffer) {
+    src->base_offset += src->current - src->buffer;
     src->length = src->length - (src->current - src->buffer);
-    memcpy(src->buffer, src->current, src->length);
+    memmove(src->buffer, src->current, src->length);
     src->current = src->buffer;
-    read_offset = src->length;
   }
+  read_offset = src->length;
   
-  n = fread(src->buffer + read_offset, sizeof(char), src->max_buffer - read_offset, src->infile);
-  if(n < src->max_buffer - read_offset) {
-    if(feof(src->infile)) {
-      src->eof = 1;
-    } else if(ferror(src->infile)) {
-      n = -1;
+  n = ds_fill_fread(src, src->buffer + read_offset, src->max_buffer - read_offset, &src->eof);
+  src->length = read_offset + (n < 0 ? 0 : n);
+  
+  return n;
+}
+
+long long ds_tell(ds_source_state_t *src)
+{
+  if(!src || !src->buffer) {
+    return src ? src->base_offset : -1;
+  }
+  return src->base_offset + (src->current - src->buffer);
+}
+
+// Drop whatever is buffered and restart the reader at offset.  Only for 
+// uncompressed input the stream can be positioned on.
+static int ds_reposition(ds_source_state_t *src, long long offset)
+{
+  struct stat st;
+  
+  if(src->compression != DS_COMPRESSION_NONE || !src->infile || 
+     fstat(fileno(src->infile), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  
+  if(src->readahead) {
+    ds_readahead_stop(src);
+#ifdef DS_WITH_IO_URING
+  } else if(src->uring) {
+    ds_uring_stop(src);
+#endif
+  }
+  if(fseeko(src->infile, offset, SEEK_SET) != 0) {
+    return -1;
+  }
+  
+  if(src->mode == DS_MODE_READAHEAD) {
+    src->buffer = NULL;
+    if(ds_readahead_start(src, ds_fill_fread) != 0) {
+      return -1;
+    }
+#ifdef DS_WITH_IO_URING
+  } else if(src->mode == DS_MODE_URING) {
+    src->buffer = NULL;
+    if(ds_uring_start(src) != 0) {
+      return -1;
     }
+#endif
   }
-  src->length = read_offset + n;
+  src->current = src->buffer;
+  src->length = 0;
+  src->base_offset = offset;
+  src->eof = 0;
   
-  return n;
+  return 0;
+}
+
+int ds_seek(ds_source_state_t *src, long long offset)
+{
+  long long position;
+  long available;
+  
+  if(!src || offset < 0) {
+    return -1;
+  }
+  
+  // the mapping or memory holds everything from offset 0
+  if(src->mode == DS_MODE_MMAP || src->mode == DS_MODE_MEMORY) {
+    if(offset > src->length) {
+      return -1;
+    }
+    src->current = src->buffer + offset;
+    return 0;
+  }
+  
+  if(ds_reposition(src, offset) == 0) {
+    return 0;
+  }
+  
+  // nothing to position on, read forward to it
+  if(offset < ds_tell(src)) {
+    return -1;
+  }
+  while((position = ds_tell(src)) < offset) {
+    available = src->buffer ? src->length - (src->current - src->buffer) : 0;
+    if(available == 0) {
+      if(src->eof || ds_load_data(src) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    if(available > offset - position) {
+      available = offset - position;
+    }
+    src->current += available;
+  }
+  
+  return 0;
+}
+
+int ds_line_time(char *p, char *end, long long *time_delta)
+{
+  long long v = 0;
+  int negative = 0, digits = 0;
+  
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+    p++;
+  }
+  if(p < end && *p == '-') {
+    negative = 1;
+    p++;
+  }
+  while(p < end && *p >= '0' && *p <= '9') {
+    v = v * 10 + (*p++ - '0');
+    digits++;
+  }
+  if(!digits || (p < end && *p != ',')) {
+    return -1;
+  }
+  *time_delta = negative ? -v : v;
+  
+  return 0;
+}
+
+int ds_peek_line(ds_source_state_t *src, char **line, char **end, char **next)
+{
+  long available;
+  char *newline;
+  int n;
+  
+  while(1) {
+    available = src->buffer ? src->length - (src->current - src->buffer) : 0;
+    newline = available > 0 ? memchr(src->current, '\n', available) : NULL;
+    if(newline || src->eof) {
+      break;
+    }
+    n = ds_load_data(src);
+    if(n < 0) {
+      return -1;
+    }
+    if(n == 0 && !src->eof) {
+      // longer than the buffer, hand out what there is
+      break;
+    }
+  }
+  if(available == 0) {
+    return 0;
+  }
+  
+  *line = src->current;
+  *next = newline ? newline + 1 : src->current + available;
+  *end = newline ? newline : *next;
+  if(*end > *line && (*end)[-1] == '\r') {
+    (*end)--;
+  }
+  return 1;
+}
+
+int ds_seek_time(ds_source_state_t *src, struct time_index_str *index, long long time_delta)
+{
+  long long line_time;
+  char *line, *end, *next;
+  int n;
+  
+  if(ds_seek(src, index ? (long long)time_index_find(index, time_delta) : 0) != 0) {
+    return -1;
+  }
+  
+  // a short read forward from the indexed line
+  while((n = ds_peek_line(src, &line, &end, &next)) > 0) {
+    if(ds_line_time(line, end, &line_time) == 0 && line_time >= time_delta) {
+      break;
+    }
+    src->current = next;
+  }
+  return n < 0 ? -1 : 0;
 }
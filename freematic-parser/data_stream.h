@@ -3,17 +3,82 @@
 
 #include <stdio.h>
 
+// how the input is brought into memory
+typedef enum {
+  DS_MODE_AUTO = 0,   // mmap regular files, buffer everything else
+  DS_MODE_BUFFERED,   // fread into a max_buffer sized buffer
+  DS_MODE_MMAP,       // whole file mapped, walked in place
+  DS_MODE_READAHEAD,  // reader thread fills the next buffer while the current one is parsed
+  DS_MODE_URING,      // io_uring reads queued into registered buffers, regular files 
+                      // only, needs -DDS_WITH_IO_URING and -luring
+  DS_MODE_MEMORY      // caller owned buffer, walked in place
+} ds_mode_t;
+
+// compressed input is detected by magic bytes and decompressed on the 
+// read-ahead thread, needs -DDS_WITH_ZLIB / -lz and -DDS_WITH_ZSTD / -lzstd
+typedef enum {
+  DS_COMPRESSION_NONE = 0,
+  DS_COMPRESSION_GZIP,
+  DS_COMPRESSION_ZSTD
+} ds_compression_t;
+
+struct ds_readahead_str;
+struct ds_uring_str;
+struct ds_decompress_str;
+
 typedef struct ds_source_state_str {
   FILE *infile;
   char *buffer;
   char *current;
   long length;
+  long long base_offset;  // input offset of buffer[0], decompressed bytes when compressed
   int  eof;
   int  max_buffer;
+  ds_mode_t mode;     // mode actually in use, never DS_MODE_AUTO
+  ds_compression_t compression;
+  
+  // bytes consumed from a pipe while sniffing for compression
+  char pending[4];
+  int  pending_length;
+  
+  // DS_MODE_READAHEAD state
+  struct ds_readahead_str *readahead;
+  
+  // DS_MODE_URING state
+  struct ds_uring_str *uring;
+  
+  // decompressor feeding the read-ahead thread
+  struct ds_decompress_str *decompress;
 } ds_source_state_t;
 
 ds_source_state_t *ds_open_file(char *filename, int max_buffer);
+ds_source_state_t *ds_open_file_mode(char *filename, int max_buffer, ds_mode_t mode);
+ds_source_state_t *ds_open_memory(char *buffer, long length, int max_buffer);
 void ds_close_file(ds_source_state_t *src);
 int ds_load_data(ds_source_state_t *src);
+int ds_mode_from_string(char *name);
+
+// Input offset of src->current, i.e. of everything consumed so far.
+long long ds_tell(ds_source_state_t *src);
+
+// Continues reading at offset.  Uncompressed files are repositioned, 
+// compressed input and pipes are read forward to it.  Returns -1 when the 
+// input ends first.
+int ds_seek(ds_source_state_t *src, long long offset);
+
+// The line at src->current without its line ending, and where the next
+// one starts.  Nothing is consumed, setting src->current to *next moves
+// on.  A line longer than the buffer comes in pieces.  1 with a line, 0 at
+// the end of the input, -1 on a read error.
+int ds_peek_line(ds_source_state_t *src, char **line, char **end, char **next);
+
+// Leading time_delta of a line, "<digits>," or the whole of a first
+// field.  -1 when it doesn't start with one.
+int ds_line_time(char *p, char *end, long long *time_delta);
+
+// Continues reading at the first line whose time_delta is at or past 
+// time_delta.  The index, when given, narrows down where reading starts.
+struct time_index_str;
+int ds_seek_time(ds_source_state_t *src, struct time_index_str *index, long long time_delta);
 
-#endif /* _DATA_STREAM_H_ */
\ No newline at end of file
+#endif /* _DATA_STREAM_H_ */
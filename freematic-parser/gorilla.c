@@ -0,0 +1,202 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "gorilla.h"
+
+typedef struct gorilla_bits_str {
+  unsigned char *data;
+  long bit;
+  long limit;       // in bits, reader only
+} gorilla_bits_t;
+
+static inline void put_bits(gorilla_bits_t *b, uint64_t v, int n)
+{
+  int space, take;
+  
+  while(n > 0) {
+    space = 8 - (b->bit & 7);
+    take = n < space ? n : space;
+    b->data[b->bit >> 3] |= ((v >> (n - take)) & ((1u << take) - 1)) << (space - take);
+    b->bit += take;
+    n -= take;
+  }
+}
+
+static inline int get_bits(gorilla_bits_t *b, int n, uint64_t *v)
+{
+  uint64_t r = 0;
+  int space, take;
+  
+  if(b->bit + n > b->limit) {
+    return -1;
+  }
+  while(n > 0) {
+    space = 8 - (b->bit & 7);
+    take = n < space ? n : space;
+    r = (r << take) | ((b->data[b->bit >> 3] >> (space - take)) & ((1u << take) - 1));
+    b->bit += take;
+    n -= take;
+  }
+  *v = r;
+  return 0;
+}
+
+// '0' for an unchanged delta, then buckets of 7, 9 and 12 bits, else 64
+static void put_delta_of_delta(gorilla_bits_t *b, int64_t dod)
+{
+  if(dod == 0) {
+    put_bits(b, 0, 1);
+  } else if(dod >= -64 && dod <= 63) {
+    put_bits(b, 0x2, 2);
+    put_bits(b, (uint64_t)dod, 7);
+  } else if(dod >= -256 && dod <= 255) {
+    put_bits(b, 0x6, 3);
+    put_bits(b, (uint64_t)dod, 9);
+  } else if(dod >= -2048 && dod <= 2047) {
+    put_bits(b, 0xe, 4);
+    put_bits(b, (uint64_t)dod, 12);
+  } else {
+    put_bits(b, 0xf, 4);
+    put_bits(b, (uint64_t)dod, 64);
+  }
+}
+
+static int get_delta_of_delta(gorilla_bits_t *b, int64_t *dod)
+{
+  static const int widths[] = { 7, 9, 12, 64 };
+  uint64_t bit, v;
+  int prefix;
+  
+  for(prefix = 0; prefix < 4; prefix++) {
+    if(get_bits(b, 1, &bit) != 0) {
+      return -1;
+    }
+    if(!bit) {
+      break;
+    }
+  }
+  if(prefix == 0) {
+    *dod = 0;
+    return 0;
+  }
+  if(get_bits(b, widths[prefix - 1], &v) != 0) {
+    return -1;
+  }
+  // sign extend the bucket
+  if(widths[prefix - 1] < 64 && (v & (1ULL << (widths[prefix - 1] - 1)))) {
+    v |= ~0ULL << widths[prefix - 1];
+  }
+  *dod = (int64_t)v;
+  return 0;
+}
+
+long gorilla_encode(const int64_t *times, const double *values, int count, char *buffer)
+{
+  gorilla_bits_t b;
+  uint64_t last, current, x;
+  int64_t delta = 0;
+  int i, leading, trailing, prev_leading = 65, prev_trailing = 0, meaningful;
+  
+  if(count <= 0) {
+    return 0;
+  }
+  memset(buffer, 0, GORILLA_MAX_LENGTH(count));
+  b.data = (unsigned char *)buffer;
+  b.bit = 0;
+  
+  memcpy(&last, &values[0], sizeof(last));
+  put_bits(&b, (uint64_t)times[0], 64);
+  put_bits(&b, last, 64);
+  
+  for(i = 1; i < count; i++) {
+    put_delta_of_delta(&b, (times[i] - times[i - 1]) - delta);
+    delta = times[i] - times[i - 1];
+    
+    memcpy(&current, &values[i], sizeof(current));
+    x = current ^ last;
+    last = current;
+    if(x == 0) {
+      put_bits(&b, 0, 1);
+      continue;
+    }
+    leading = __builtin_clzll(x);
+    trailing = __builtin_ctzll(x);
+    if(leading > 31) {
+      leading = 31;
+    }
+    if(leading >= prev_leading && trailing >= prev_trailing) {
+      // fits the previous window
+      put_bits(&b, 0x2, 2);
+      put_bits(&b, x >> prev_trailing, 64 - prev_leading - prev_trailing);
+    } else {
+      meaningful = 64 - leading - trailing;
+      put_bits(&b, 0x3, 2);
+      put_bits(&b, leading, 5);
+      put_bits(&b, meaningful & 63, 6);
+      put_bits(&b, x >> trailing, meaningful);
+      prev_leading = leading;
+      prev_trailing = trailing;
+    }
+  }
+  
+  return (b.bit + 7) >> 3;
+}
+
+int gorilla_decode(const char *buffer, long length, int count, int64_t *times, double *values)
+{
+  gorilla_bits_t b;
+  uint64_t last, v, control;
+  int64_t delta = 0, dod;
+  int i, leading = 0, trailing = 0, meaningful;
+  
+  if(count <= 0) {
+    return 0;
+  }
+  b.data = (unsigned char *)buffer;
+  b.bit = 0;
+  b.limit = length * 8;
+  
+  if(get_bits(&b, 64, &v) != 0 || get_bits(&b, 64, &last) != 0) {
+    return -1;
+  }
+  times[0] = (int64_t)v;
+  memcpy(&values[0], &last, sizeof(last));
+  
+  for(i = 1; i < count; i++) {
+    if(get_delta_of_delta(&b, &dod) != 0) {
+      return -1;
+    }
+    delta += dod;
+    times[i] = times[i - 1] + delta;
+    
+    if(get_bits(&b, 1, &control) != 0) {
+      return -1;
+    }
+    if(control) {
+      if(get_bits(&b, 1, &control) != 0) {
+        return -1;
+      }
+      if(control) {
+        if(get_bits(&b, 5, &v) != 0) {
+          return -1;
+        }
+        leading = v;
+        if(get_bits(&b, 6, &v) != 0) {
+          return -1;
+        }
+        meaningful = v ? v : 64;
+        trailing = 64 - leading - meaningful;
+        if(trailing < 0) {
+          return -1;
+        }
+      }
+      if(get_bits(&b, 64 - leading - trailing, &v) != 0) {
+        return -1;
+      }
+      last ^= v << trailing;
+    }
+    memcpy(&values[i], &last, sizeof(last));
+  }
+  
+  return count;
+}
@@ -0,0 +1,20 @@
+#ifndef _GORILLA_H_
+#define _GORILLA_H_
+
+#include <stdint.h>
+
+// Time series compression after Facebook's Gorilla: timestamps as delta of
+// deltas in variable width buckets, values xor'ed with the previous one so
+// repeats cost one bit and slow changes only their differing bits.
+
+// worst case bytes for count samples, first sample raw then at most 
+// 68 bits per time and 77 per value
+#define GORILLA_MAX_LENGTH(count) (16 + ((long)(count) * 145 + 7) / 8)
+
+// Encodes count samples into buffer, returns the bytes used.
+long gorilla_encode(const int64_t *times, const double *values, int count, char *buffer);
+
+// Decodes count samples, returns count or -1 when buffer runs out early.
+int gorilla_decode(const char *buffer, long length, int count, int64_t *times, double *values);
+
+#endif /* _GORILLA_H_ */
@@ -8,14 +8,28 @@
 #include <MQTTClientPersistence.h>
 
 #include "data_stream.h"
+#include "cbor.h"
+#include "checkpoint.h"
+#include "spool.h"
 
 #define BUFFER_LENGTH 2048
 
+// with a spool, between attempts while the broker is away
+#define RECONNECT_SECONDS 1
+// spooled messages replayed between two reads of the input
+#define SPOOL_DRAIN       64
+
 typedef struct json_msg_str {
   char *body;
   int  length;
 } json_msg_t;
 
+// How a message sits in the spool, body runs to the end of the record.
+typedef struct spooled_msg_str {
+  long long offset;   // input offset just past the message
+  char body[];
+} spooled_msg_t;
+
 void reset_json_msg(json_msg_t *msg) 
 {
   if(msg) {
@@ -61,7 +75,7 @@ int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
       if(n < 0) {
         return -1;
       }
-      available = src->length - idx;
+      available = src->length - (src->current - src->buffer) - idx;
     }
     if(available == 0) {
       idx = 0;
@@ -104,6 +118,51 @@ int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
   return idx;
 }
 
+// Length framed records as written by csv_to_json -o cbor.  Returns the
+// record length, 0 when no whole record is buffered yet.
+int next_frame(ds_source_state_t *src, json_msg_t *msg)
+{
+  unsigned long available;
+  unsigned long len;
+  int n;
+  
+  if(!src || !msg) {
+    return -1;
+  }
+  
+  msg->body = NULL;
+  msg->length = 0;
+  available = src->length - (src->current - src->buffer);
+  while(1) {
+    if(available >= CBOR_FRAME_HEADER) {
+      len = cbor_frame_length(src->current);
+      if(len + CBOR_FRAME_HEADER > src->max_buffer) {
+        // can never be buffered whole
+        return -1;
+      }
+      if(available >= len + CBOR_FRAME_HEADER) {
+        msg->body = (char *)calloc(len + 1, sizeof(char));
+        msg->length = len;
+        memcpy(msg->body, src->current + CBOR_FRAME_HEADER, len);
+        src->current = src->current + CBOR_FRAME_HEADER + len;
+        return len;
+      }
+    }
+    if(src->eof) {
+      return 0;
+    }
+    
+    n = ds_load_data(src);
+    if(n < 0) {
+      return -1;
+    }
+    available = src->length - (src->current - src->buffer);
+    if(n == 0 && !src->eof) {
+      return 0;
+    }
+  }
+}
+
 void usage(char *command_line)
 {
 	printf("mqtt publisher\n");
@@ -113,11 +172,17 @@ void usage(char *command_line)
 	printf("  -q <qos> -- qos (default: 0)\n");
 	printf("  -r -- retained (default: off)\n");
 	printf("  -d <delim> -- delimiter (default: \\n)");
+	printf("  -l -- length framed records (csv_to_json -o cbor) instead of delimited\n");
 	printf("  -c <clientid> -- clientid (default: hostname+timestamp)");
 	printf("  -m <len> -- maximum data length (default: 2048)\n");
 	printf("  -u <username> -- username (default: none)\n");
 	printf("  -w <password> -- password (default: none)\n");
 	printf("  -t <topic> -- topic to publish to (default: test)\n");
+	printf("  -f <file> -- input file (default: stdin)\n");
+	printf("  -i <mode> -- input mode: auto, buffered, mmap, readahead, uring (default: auto)\n");
+	printf("  -s <file> -- keep the input offset published so far in file and resume from it\n");
+	printf("  -S <seconds> -- with -s, how often the offset is saved, SIGUSR1 saves it now (default: 10)\n");
+	printf("  -o <dir> -- spool messages to disk in dir while the broker is away and replay them in order (default: off)\n");
 	exit(-1);
 }
 
@@ -141,9 +206,14 @@ struct config_str {
   int     qos;
   int     retained;
   char    *delimiter;
+  int     framed;
   char    *client_id;
   int     maximum_length;
   char    *input_file;
+  int     input_mode;
+  char    *checkpoint_file;
+  int     checkpoint_interval;
+  char    *spool_directory;
 };
 
 struct config_str *config_base(void)
@@ -158,8 +228,13 @@ struct config_str *config_base(void)
     config->qos = 0;
     config->retained = 0;
     config->delimiter = strdup("\n");
+    config->framed = 0;
     config->client_id = get_client_id();
     config->maximum_length = 2048;
+    config->input_mode = DS_MODE_AUTO;
+    config->checkpoint_file = NULL;
+    config->checkpoint_interval = 10;
+    config->spool_directory = NULL;
   }
   return config;
 }
@@ -188,13 +263,19 @@ void config_free(struct config_str *config)
     if(config->input_file) {
       free(config->input_file);
     }
+    if(config->checkpoint_file) {
+      free(config->checkpoint_file);
+    }
+    if(config->spool_directory) {
+      free(config->spool_directory);
+    }
     free(config);
   }
 }
 
 struct config_str *parse_command_line(int argc, char **argv)
 {
-  char *options = "h:p:q:rd:c:m:u:w:t:?f:";
+  char *options = "h:p:q:rd:c:m:u:w:t:?f:i:ls:S:o:";
   char c;
   
   struct config_str *config = config_base();
@@ -228,6 +309,27 @@ struct config_str *parse_command_line(int argc, char **argv)
           }
           config->delimiter = strdup(optarg);
           break;
+        case 'l':
+          config->framed = 1;
+          break;
+        case 's':
+          if(config->checkpoint_file) {
+            free(config->checkpoint_file);
+          }
+          config->checkpoint_file = strdup(optarg);
+          break;
+        case 'S':
+          config->checkpoint_interval = atoi(optarg);
+          if(config->checkpoint_interval < 0) {
+            goto bugout;
+          }
+          break;
+        case 'o':
+          if(config->spool_directory) {
+            free(config->spool_directory);
+          }
+          config->spool_directory = strdup(optarg);
+          break;
         case 'c':
           if(config->client_id) {
             free(config->client_id);
@@ -261,6 +363,12 @@ struct config_str *parse_command_line(int argc, char **argv)
         case 'f':
           config->input_file = strdup(optarg);
           break;
+        case 'i':
+          config->input_mode = ds_mode_from_string(optarg);
+          if(config->input_mode < 0) {
+            goto bugout;
+          }
+          break;
         case '?':
           goto bugout;
       }
@@ -284,6 +392,10 @@ typedef struct mqtt_client_str {
   MQTTClient client;
   MQTTClient_connectOptions connection_opts;
   
+  // connection details, only followed with a spool
+  int connected;
+  time_t last_connect;
+  
   // config details
   int verbose;
 } mqtt_client_t;
@@ -333,8 +445,75 @@ void mqtt_connect(mqtt_client_t* client)
 	}
 }
 
+// Doesn't give up, with a spool the messages wait there meanwhile.
+int mqtt_try_connect(mqtt_client_t *client)
+{
+  printf("Connecting\n");
+  client->last_connect = time(NULL);
+  client->connected = MQTTClient_connect(client->client, &client->connection_opts) == 0;
+  if(!client->connected) {
+    printf("Failed to connect\n");
+  }
+  return client->connected ? 0 : -1;
+}
+
+// Reconnects when it is time and publishes up to SPOOL_DRAIN spooled
+// messages, oldest first.
+void replay_spool(mqtt_client_t *client, struct config_str *config, spool_t *spool,
+                  long long *published_offset)
+{
+  spooled_msg_t *spooled;
+  uint32_t length;
+  int i;
+  
+  if(!client->connected && time(NULL) - client->last_connect >= RECONNECT_SECONDS) {
+    mqtt_try_connect(client);
+  }
+  for(i = 0; client->connected && i < SPOOL_DRAIN; i++) {
+    spooled = (spooled_msg_t *)spool_peek(spool, &length);
+    if(!spooled) {
+      break;
+    }
+    if(MQTTClient_publish(client->client, config->topic, length - sizeof(spooled_msg_t),
+                          spooled->body, config->qos, config->retained, NULL) != 0) {
+      client->connected = 0;
+      break;
+    }
+    *published_offset = spooled->offset;
+    spool_release(spool);
+  }
+}
+
+// Queues a message behind the spooled ones.  While the disk is full it
+// replays what it can to make room, and once nothing is ahead of the
+// message it goes straight to the broker.
+void spool_message(mqtt_client_t *client, struct config_str *config, spool_t *spool,
+                   json_msg_t *msg, long long offset, long long *published_offset)
+{
+  while(spool_append(spool, &offset, sizeof(offset), msg->body, msg->length) != 0 &&
+        !checkpoint_exit_requested) {
+    if(!client->connected) {
+      fprintf(stderr, "Unable to spool a message, retrying\n");
+      sleep(1);
+    }
+    replay_spool(client, config, spool, published_offset);
+    if(client->connected && spool_queued(spool) == 0) {
+      if(MQTTClient_publish(client->client, config->topic, msg->length, msg->body,
+                            config->qos, config->retained, NULL) == 0) {
+        *published_offset = offset;
+        return;
+      }
+      client->connected = 0;
+    }
+  }
+}
+
 int main(int argc, char **argv)
 {
+  checkpoint_t *checkpoint = NULL;
+  spool_t *spool = NULL;
+  long long resume = 0, published_offset;
+  size_t segment_length;
   int n, rc;
   json_msg_t *msg = (json_msg_t *)calloc(1, sizeof(json_msg_t));
   
@@ -344,29 +523,112 @@ int main(int argc, char **argv)
   }
   
   mqtt_client_t *client = mqtt_initialize_client(config);
-  mqtt_connect(client);
+  if(config->spool_directory) {
+    // runs without the broker, what can't be published waits in the spool
+    mqtt_try_connect(client);
+  } else {
+    mqtt_connect(client);
+  }
+  
+  // room for the longest message with some to spare for reading on
+  ds_source_state_t *src = ds_open_file_mode(config->input_file, config->maximum_length + BUFFER_LENGTH,
+                                             config->input_mode);
+  if(src == NULL) {
+    fprintf(stderr, "Unable to open input: %s\n", config->input_file ? config->input_file : "stdin");
+    exit(-1);
+  }
+  if(config->checkpoint_file) {
+    checkpoint = checkpoint_open(config->checkpoint_file, src->infile, 
+                                 config->checkpoint_interval, &resume);
+    if(checkpoint == NULL) {
+      fprintf(stderr, "Unable to use checkpoint: %s\n", config->checkpoint_file);
+      exit(-1);
+    }
+    if(resume > 0 && ds_seek(src, resume) != 0) {
+      fprintf(stderr, "Unable to resume input at offset %lld\n", resume);
+      exit(-1);
+    }
+  }
+  published_offset = resume;
   
-  ds_source_state_t *src = ds_open_file(config->input_file, BUFFER_LENGTH);
+  // with a checkpoint the input is read again from what was published,
+  // whatever was spooled last time is in there
+  if(config->spool_directory) {
+    segment_length = 64 * (sizeof(spooled_msg_t) + config->maximum_length);
+    spool = spool_open(config->spool_directory,
+                       segment_length > SPOOL_SEGMENT_LENGTH ? segment_length : SPOOL_SEGMENT_LENGTH,
+                       checkpoint == NULL);
+    if(spool == NULL) {
+      fprintf(stderr, "Unable to open spool: %s\n", config->spool_directory);
+      exit(-1);
+    }
+  }
   while(1) {
-    n = next_message(src, "\n", msg);
-    if(n == 0) {
+    if(spool) {
+      replay_spool(client, config, spool, &published_offset);
+    }
+    
+    if(config->framed) {
+      n = next_frame(src, msg);
+    } else {
+      n = next_message(src, config->delimiter, msg);
+    }
+    if(n < 0) {
+      fprintf(stderr, "Error reading input\n");
+      break;
+    } else if(n == 0) {
       if(src->eof) {
-        // all done with input
-        break;
+        // all done with input, and with the spool once it is replayed
+        if(!spool || spool_queued(spool) == 0) {
+          break;
+        }
+        if(!client->connected) {
+          usleep(10000);
+        }
       } else {
         usleep(10000);
       }
+    } else if(spool && (!client->connected || spool_queued(spool) > 0)) {
+      // behind what is spooled already, or the broker is away
+      spool_message(client, config, spool, msg, ds_tell(src), &published_offset);
+      reset_json_msg(msg);
     } else {
       rc = MQTTClient_publish(client->client, config->topic, msg->length, msg->body,
                               config->qos, config->retained, NULL);
-      if(rc != 0) {
+      if(rc != 0 && spool) {
+        // the next message goes to the spool behind this one
+        client->connected = 0;
+        spool_message(client, config, spool, msg, ds_tell(src), &published_offset);
+      } else if(rc != 0) {
         mqtt_connect(client);
         rc = MQTTClient_publish(client->client, config->topic, msg->length, msg->body,
                                 config->qos, config->retained, NULL);
       }        
+      if(rc == 0) {
+        published_offset = ds_tell(src);
+      }
       reset_json_msg(msg);
     }
+    
+    // publishing is synchronous, everything read so far is out unless it
+    // is waiting in the spool
+    if(checkpoint && checkpoint_due(checkpoint)) {
+      if(checkpoint_save(checkpoint, spool ? published_offset : ds_tell(src)) != 0) {
+        fprintf(stderr, "Unable to save checkpoint: %s\n", config->checkpoint_file);
+      }
+      if(checkpoint_exit_requested) {
+        break;
+      }
+    }
   }
+  if(checkpoint) {
+    if(checkpoint_save(checkpoint, spool ? published_offset : ds_tell(src)) != 0) {
+      fprintf(stderr, "Unable to save checkpoint: %s\n", config->checkpoint_file);
+    }
+    checkpoint_close(checkpoint);
+  }
+  
+  spool_close(spool);
   
   MQTTClient_disconnect(client->client, 0);
  	MQTTClient_destroy(&client->client);
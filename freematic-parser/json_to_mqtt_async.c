@@ -1,43 +1,42 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "MQTTAsync.h"
 
 #include "data_stream.h"
+#include "cbor.h"
+#include "checkpoint.h"
+#include "spool.h"
 #include "ring_buffer.h"
 
 #define BUFFER_LENGTH 2048
 
+// longest the publisher sleeps without a message or a callback, bounds how
+// late a checkpoint is saved
+#define WAIT_MS       1000
+
+// between attempts after a failed connect
+#define RECONNECT_SECONDS 1
+
+// Lives in a ring slot, body takes the rest of the slot.
 typedef struct json_msg_str {
-  char *body;
   int  length;
+  long long offset;   // input offset just past the message
+  char body[];
 } json_msg_t;
 
-void reset_json_msg(json_msg_t *msg) 
-{
-  if(msg) {
-    if(msg->body) {
-      free(msg->body);
-    }
-    msg->length = 0;
-  }
-}
-
-void free_json_msg(json_msg_t *msg)
-{
-  if(msg) {
-    reset_json_msg(msg);
-    free(msg);
-  }
-}
-
-int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
+// Returns the message length, the body is only filled in when it is no
+// longer than capacity.  What is scanned of a longer one is dropped as it
+// goes, so it needn't fit in the input buffer.
+int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg, int capacity)
 {
   unsigned long available;
-  int n, idx, dlen, more_data;
+  int n, idx, dlen, more_data, skipped = 0;
   char c;
   
   if(!src || !delimiter || !msg) {
@@ -46,7 +45,6 @@ int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
 
   dlen = strlen(delimiter);
 
-  msg->body = NULL;
   msg->length = 0;
   available = src->length - (src->current - src->buffer);
   if((available == 0) && src->eof) {
@@ -57,11 +55,16 @@ int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
   more_data = 0;
   while(1) {
     if(more_data || ((available < src->max_buffer / 8) && !src->eof)) {
+      if(idx > capacity) {
+        skipped += idx;
+        src->current += idx;
+        idx = 0;
+      }
       n = ds_load_data(src);
       if(n < 0) {
         return -1;
       }
-      available = src->length - idx;
+      available = src->length - (src->current - src->buffer) - idx;
     }
     if(available == 0) {
       idx = 0;
@@ -76,9 +79,11 @@ int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
           n++;
         }
         if(n == dlen) {
-          msg->body = (char *)calloc(idx + 1, sizeof(char));
-          msg->length = idx;
-          memcpy(msg->body, src->current, idx);
+          msg->length = skipped + idx;
+          if(msg->length <= capacity) {
+            memcpy(msg->body, src->current, idx);
+            msg->body[idx] = '\0';
+          }
           src->current = src->current + idx + dlen;
           break;
         } else {
@@ -101,7 +106,59 @@ int next_message(ds_source_state_t *src, char *delimiter, json_msg_t *msg)
     }
   }  
 
-  return idx;
+  return msg->length;
+}
+
+// Length framed records as written by csv_to_json -o cbor.  Returns the
+// record length, 0 when no whole record is buffered yet.  As with
+// next_message the body is only filled in when it fits, a record too long
+// for the input buffer is read past.
+int next_frame(ds_source_state_t *src, json_msg_t *msg, int capacity)
+{
+  unsigned long available;
+  unsigned long len;
+  int n;
+  
+  if(!src || !msg) {
+    return -1;
+  }
+  
+  msg->length = 0;
+  available = src->length - (src->current - src->buffer);
+  while(1) {
+    if(available >= CBOR_FRAME_HEADER) {
+      len = cbor_frame_length(src->current);
+      if(len + CBOR_FRAME_HEADER > src->max_buffer) {
+        // can never be buffered whole
+        if(ds_seek(src, ds_tell(src) + CBOR_FRAME_HEADER + len) != 0) {
+          return src->eof ? 0 : -1;
+        }
+        msg->length = len > INT_MAX ? INT_MAX : len;
+        return msg->length;
+      }
+      if(available >= len + CBOR_FRAME_HEADER) {
+        msg->length = len;
+        if(len <= (unsigned long)capacity) {
+          memcpy(msg->body, src->current + CBOR_FRAME_HEADER, len);
+          msg->body[len] = '\0';
+        }
+        src->current = src->current + CBOR_FRAME_HEADER + len;
+        return len;
+      }
+    }
+    if(src->eof) {
+      return 0;
+    }
+    
+    n = ds_load_data(src);
+    if(n < 0) {
+      return -1;
+    }
+    available = src->length - (src->current - src->buffer);
+    if(n == 0 && !src->eof) {
+      return 0;
+    }
+  }
 }
 
 void usage(char *command_line)
@@ -113,11 +170,17 @@ void usage(char *command_line)
 	printf("  -q <qos> -- qos (default: 0)\n");
 	printf("  -r -- retained (default: off)\n");
 	printf("  -d <delim> -- delimiter (default: \\n)");
+	printf("  -l -- length framed records (csv_to_json -o cbor) instead of delimited\n");
 	printf("  -c <clientid> -- clientid (default: hostname+timestamp)");
 	printf("  -m <len> -- maximum data length (default: 2048)\n");
 	printf("  -u <username> -- username (default: none)\n");
 	printf("  -w <password> -- password (default: none)\n");
 	printf("  -t <topic> -- topic to publish to (default: test)\n");
+	printf("  -f <file> -- input file (default: stdin)\n");
+	printf("  -i <mode> -- input mode: auto, buffered, mmap, readahead, uring (default: auto)\n");
+	printf("  -s <file> -- keep the input offset published so far in file and resume from it\n");
+	printf("  -S <seconds> -- with -s, how often the offset is saved, SIGUSR1 saves it now (default: 10)\n");
+	printf("  -o <dir> -- spool messages to disk in dir while the broker is away and replay them in order (default: off)\n");
 	exit(-1);
 }
 
@@ -141,9 +204,14 @@ struct config_str {
   int     qos;
   int     retained;
   char    *delimiter;
+  int     framed;
   char    *client_id;
   int     maximum_length;
   char    *input_file;
+  int     input_mode;
+  char    *checkpoint_file;
+  int     checkpoint_interval;
+  char    *spool_directory;
 };
 
 struct config_str *config_base(void)
@@ -158,8 +226,13 @@ struct config_str *config_base(void)
     config->qos = 0;
     config->retained = 0;
     config->delimiter = strdup("\n");
+    config->framed = 0;
     config->client_id = get_client_id();
     config->maximum_length = 2048;
+    config->input_mode = DS_MODE_AUTO;
+    config->checkpoint_file = NULL;
+    config->checkpoint_interval = 10;
+    config->spool_directory = NULL;
   }
   return config;
 }
@@ -188,13 +261,19 @@ void config_free(struct config_str *config)
     if(config->input_file) {
       free(config->input_file);
     }
+    if(config->checkpoint_file) {
+      free(config->checkpoint_file);
+    }
+    if(config->spool_directory) {
+      free(config->spool_directory);
+    }
     free(config);
   }
 }
 
 struct config_str *parse_command_line(int argc, char **argv)
 {
-  char *options = "h:p:q:rd:c:m:u:w:t:?f:";
+  char *options = "h:p:q:rd:c:m:u:w:t:?f:i:ls:S:o:";
   char c;
   
   struct config_str *config = config_base();
@@ -228,6 +307,27 @@ struct config_str *parse_command_line(int argc, char **argv)
           }
           config->delimiter = strdup(optarg);
           break;
+        case 'l':
+          config->framed = 1;
+          break;
+        case 's':
+          if(config->checkpoint_file) {
+            free(config->checkpoint_file);
+          }
+          config->checkpoint_file = strdup(optarg);
+          break;
+        case 'S':
+          config->checkpoint_interval = atoi(optarg);
+          if(config->checkpoint_interval < 0) {
+            goto bugout;
+          }
+          break;
+        case 'o':
+          if(config->spool_directory) {
+            free(config->spool_directory);
+          }
+          config->spool_directory = strdup(optarg);
+          break;
         case 'c':
           if(config->client_id) {
             free(config->client_id);
@@ -236,7 +336,7 @@ struct config_str *parse_command_line(int argc, char **argv)
           break;
         case 'm':
           config->maximum_length = atoi(optarg);
-          if(config->maximum_length < 0) {
+          if(config->maximum_length <= 0) {
             goto bugout;
           }
           break;
@@ -261,6 +361,12 @@ struct config_str *parse_command_line(int argc, char **argv)
         case 'f':
           config->input_file = strdup(optarg);
           break;
+        case 'i':
+          config->input_mode = ds_mode_from_string(optarg);
+          if(config->input_mode < 0) {
+            goto bugout;
+          }
+          break;
         case '?':
           goto bugout;
       }
@@ -293,14 +399,18 @@ typedef struct mqtt_client_str {
   // connection details
   int connected;
   int working;
+  time_t last_connect;
   
   // message info
   ring_buffer_t *message_ring;
+  spool_t *spool;
   
   // publish details
   json_msg_t *current_message;
+  int current_spooled;          // current_message is in the spool, not the ring
   int published;
   int publish_attempts;
+  long long published_offset;   // input offset of everything acknowledged
   
   // disconnect
   int disconnected;
@@ -315,6 +425,7 @@ void mqtt_callback_connection_lost(void* context, char* cause)
 	mqtt_client_t *client = (mqtt_client_t *)context;
 	if(client) {
     client->connected = 0;
+    ring_buffer_notify(client->message_ring);
     
     printf("Connecting\n");
     if ((rc = MQTTAsync_connect(client->client, &client->connection_opts)) != MQTTASYNC_SUCCESS) {
@@ -337,6 +448,7 @@ void mqtt_callback_on_connect_failure(void* context, MQTTAsync_failureData* resp
   mqtt_client_t *client = (mqtt_client_t *)context;
   if(client) {
     client->connected = -1;
+    ring_buffer_notify(client->message_ring);
   }
 }
 
@@ -346,6 +458,7 @@ void mqtt_callback_on_connect(void* context, MQTTAsync_successData* response)
   mqtt_client_t *client = (mqtt_client_t *)context;
   if(client) {
     client->connected = 1;
+    ring_buffer_notify(client->message_ring);
   }	
 }
 
@@ -357,6 +470,7 @@ void mqtt_callback_publish_failure(void* context, MQTTAsync_failureData* respons
     client->published = -1; 
     client->publish_attempts++;
     client->working = 0;
+    ring_buffer_notify(client->message_ring);
   }
 }
 
@@ -367,8 +481,9 @@ void mqtt_callback_publish_success(void* context, MQTTAsync_successData* respons
 	static int i = 0;
 	fprintf(stderr, "published -- %d\n", i++);
 	  client->published = 1;
-	  free_json_msg(client->current_message);
+	  __atomic_store_n(&client->published_offset, client->current_message->offset, __ATOMIC_RELEASE);
 	  client->working = 0;
+	  ring_buffer_notify(client->message_ring);
 	}
 }
 
@@ -426,6 +541,7 @@ mqtt_client_t *mqtt_initialize_client(struct config_str *config, ring_buffer_t *
 void mqtt_connect(mqtt_client_t *client)
 {
   int rc;
+  client->last_connect = time(NULL);
 	if ((rc = MQTTAsync_connect(client->client, &client->connection_opts)) != MQTTASYNC_SUCCESS)
 	{
 		printf("Failed to start connect, return code %d\n", rc);
@@ -435,82 +551,277 @@ void mqtt_connect(mqtt_client_t *client)
 
 #define ALLOWED_PUBLISH_ATTEMPTS 5
 
+// ring slots taken at once by the publisher, and handed back together
+#define RING_BURST 16
+
+typedef struct reader_str {
+  ds_source_state_t *src;
+  struct config_str *config;
+  ring_buffer_t *ring;
+  spool_t *spool;
+  json_msg_t *overflow;     // message on its way to the spool
+  mqtt_client_t *client;
+} reader_t;
+
+// Picks where the next message is read to, a ring slot, waiting for one
+// while the ring is full.  With a spool and the broker away a full ring
+// sends messages to the spool instead, and they keep going there until
+// the publisher has caught up, so the order holds.  While connected the
+// reader waits for the backlog to go out rather than adding to it.
+json_msg_t *next_slot(reader_t *reader)
+{
+  json_msg_t *msg = NULL;
+  
+  if(!reader->spool) {
+    ring_buffer_reserve_wait(reader->ring, (void **)&msg, -1);
+    return msg;
+  }
+  while(!msg && !ring_buffer_closed(reader->ring)) {
+    if(spool_queued(reader->spool) == 0) {
+      if(reader->client->connected == 1) {
+        // comes back now and then to see if the connection dropped
+        ring_buffer_reserve_wait(reader->ring, (void **)&msg, WAIT_MS);
+      } else if((msg = (json_msg_t *)ring_buffer_reserve(reader->ring)) == NULL) {
+        msg = reader->overflow;
+      }
+    } else if(reader->client->connected != 1) {
+      msg = reader->overflow;
+    } else {
+      usleep(10000);
+    }
+  }
+  return msg;
+}
+
+// The publisher takes spooled messages once the ring is empty.  When the
+// disk is full this waits for it to drain some, or with nothing spooled
+// ahead of the message, for a ring slot like it would without a spool.
+int spool_message(reader_t *reader, json_msg_t *msg)
+{
+  json_msg_t *slot;
+  
+  while(spool_append(reader->spool, msg, sizeof(json_msg_t), msg->body, msg->length + 1) != 0) {
+    if(ring_buffer_closed(reader->ring)) {
+      return -1;
+    }
+    if(spool_queued(reader->spool) == 0) {
+      if(ring_buffer_reserve_wait(reader->ring, (void **)&slot, WAIT_MS) == RING_BUFFER_OK) {
+        memcpy(slot, msg, sizeof(json_msg_t) + msg->length + 1);
+        ring_buffer_commit(reader->ring);
+        return 0;
+      }
+      continue;
+    }
+    fprintf(stderr, "Unable to spool a message, retrying\n");
+    sleep(1);
+  }
+  ring_buffer_notify(reader->ring);
+  
+  return 0;
+}
+
+// Reads messages straight into ring slots, or the spool, and closes the
+// ring at the end of the input or once the publisher has closed it.
+void *read_messages(void *arg)
+{
+  reader_t *reader = (reader_t *)arg;
+  int capacity = reader->config->maximum_length;
+  json_msg_t *msg;
+  int n;
+  
+  while((msg = next_slot(reader)) != NULL) {
+    if(reader->config->framed) {
+      n = next_frame(reader->src, msg, capacity);
+    } else {
+      n = next_message(reader->src, reader->config->delimiter, msg, capacity);
+    }
+    if(n < 0) {
+      fprintf(stderr, "Error reading input\n");
+      break;
+    } else if(n == 0) {
+      if(reader->src->eof) {
+        break;
+      }
+    } else if(n > capacity) {
+      fprintf(stderr, "Skipping a %d byte message, longer than -m\n", n);
+    } else {
+      msg->offset = ds_tell(reader->src);
+      if(msg != reader->overflow) {
+        ring_buffer_commit(reader->ring);
+      } else if(spool_message(reader, msg) != 0) {
+        break;
+      }
+    }
+  }
+  ring_buffer_close(reader->ring);
+  
+  return NULL;
+}
+
 int main(int argc, char **argv)
 {
-  int n, rc, wait = 0;
-  int done_reading = 0, doing_work = 0;;
+  checkpoint_t *checkpoint = NULL;
+  long long resume = 0;
+  pthread_t reader_thread;
+  reader_t reader;
+  json_msg_t *burst[RING_BURST];
+  int burst_count = 0, burst_next = 0;
+  uint32_t length;
+  uint64_t lost = 0;
+  size_t slot_length;
+  int rc;
   
   struct config_str *config = parse_command_line(argc, argv);
   if(config == NULL) {
     usage(argv[0]);
   }
   
-  ring_buffer_t *ring = ring_buffer_create(20);
+  slot_length = sizeof(json_msg_t) + config->maximum_length + 1;
+  ring_buffer_t *ring = ring_buffer_create_slots(20, slot_length);
+  if(ring == NULL) {
+    fprintf(stderr, "Unable to allocate the message ring\n");
+    exit(-1);
+  }
   mqtt_client_t *client = mqtt_initialize_client(config, ring);
   mqtt_connect(client);
   
-  ds_source_state_t *src = ds_open_file(config->input_file, BUFFER_LENGTH);
-  json_msg_t *msg = (json_msg_t *)calloc(1, sizeof(json_msg_t));  
+  // room for the longest message and its delimiter, or frame header,
+  // with some to spare for reading on
+  ds_source_state_t *src = ds_open_file_mode(config->input_file, config->maximum_length + BUFFER_LENGTH,
+                                             config->input_mode);
+  if(src == NULL) {
+    fprintf(stderr, "Unable to open input: %s\n", config->input_file ? config->input_file : "stdin");
+    exit(-1);
+  }
+  if(config->checkpoint_file) {
+    checkpoint = checkpoint_open(config->checkpoint_file, src->infile, 
+                                 config->checkpoint_interval, &resume);
+    if(checkpoint == NULL) {
+      fprintf(stderr, "Unable to use checkpoint: %s\n", config->checkpoint_file);
+      exit(-1);
+    }
+    if(resume > 0 && ds_seek(src, resume) != 0) {
+      fprintf(stderr, "Unable to resume input at offset %lld\n", resume);
+      exit(-1);
+    }
+  }
+  client->published_offset = resume;
+  
+  // with a checkpoint the input is read again from what was acknowledged,
+  // whatever was spooled last time is in there
+  if(config->spool_directory) {
+    client->spool = spool_open(config->spool_directory,
+                               slot_length * 64 > SPOOL_SEGMENT_LENGTH ? slot_length * 64 : SPOOL_SEGMENT_LENGTH,
+                               checkpoint == NULL);
+    if(client->spool == NULL) {
+      fprintf(stderr, "Unable to open spool: %s\n", config->spool_directory);
+      exit(-1);
+    }
+  }
+  
+  reader.src = src;
+  reader.config = config;
+  reader.ring = ring;
+  reader.spool = client->spool;
+  reader.overflow = (json_msg_t *)malloc(slot_length);
+  reader.client = client;
+  if(pthread_create(&reader_thread, NULL, read_messages, &reader) != 0) {
+    fprintf(stderr, "Unable to start the input thread\n");
+    exit(-1);
+  }
+  
+  // sleeps in the ring until a message is queued or a callback says the
+  // connection or the message in flight changed.  Ring slots are taken a
+  // burst at a time and keep their messages until the whole burst has been
+  // acknowledged or given up on.
   while(1) {
-    // check for reads / fill buffer
-    doing_work = 0;
-    if(ring_buffer_available_slots(client->message_ring) > 0) {
-      if(!done_reading) {
-        n = next_message(src, "\n", msg);
-        if(n == 0) {
-          if(src->eof) {
-            done_reading = 1;
-          }
+    // a stop request leaves once nothing is in flight, or straight away
+    // without a connection.  What is queued is read again next time.
+    if(checkpoint_exit_requested) {
+      ring_buffer_close(client->message_ring);
+      if(!client->working || client->connected != 1) {
+        break;
+      }
+    }
+    if(client->connected == 1 && !client->working) {
+      json_msg_t *out_msg = NULL;
+      if(client->current_message) {
+        if(client->published == -1 && client->publish_attempts < ALLOWED_PUBLISH_ATTEMPTS) {
+          out_msg = client->current_message;
         } else {
-          doing_work = 1;
-          ring_buffer_write(client->message_ring, msg);
-          msg = NULL;
-          msg = (json_msg_t *)calloc(1, sizeof(json_msg_t));
+          if(client->current_spooled) {
+            spool_release(client->spool);
+          } else if(++burst_next == burst_count) {
+            ring_buffer_release_many(client->message_ring, burst_count);
+            burst_count = burst_next = 0;
+          }
+          client->current_message = NULL;
         }
       }
-    }
-
-    if(client->connected == 1) {
-      if(!client->working) {
-        json_msg_t *out_msg = NULL;
-        if(client->published == -1) {
-          if(client->publish_attempts < ALLOWED_PUBLISH_ATTEMPTS) {
-            out_msg = client->current_message;
-            client->current_message = NULL;
-          } else {
-            free_json_msg(client->current_message);
-            client->current_message = NULL;
+      if(!out_msg) {
+        // anything in the ring went in before the spool was started
+        client->current_spooled = 0;
+        if(burst_count == 0) {
+          burst_count = ring_buffer_peek_many(client->message_ring, (void **)burst, RING_BURST);
+        }
+        if(burst_count > 0) {
+          out_msg = burst[burst_next];
+        } else if(client->spool) {
+          out_msg = (json_msg_t *)spool_peek(client->spool, &length);
+          client->current_spooled = out_msg != NULL;
+          if(client->spool->lost > lost) {
+            fprintf(stderr, "Lost %llu spooled messages, their segment is missing or damaged\n",
+                    (unsigned long long)(client->spool->lost - lost));
+            lost = client->spool->lost;
           }
         }
         if(!out_msg) {
-          if(ring_buffer_available_data(client->message_ring)) {
-            out_msg = (json_msg_t *)ring_buffer_read(client->message_ring);
-            client->publish_attempts = 0;
+          // the burst is taken on the next time round
+          rc = ring_buffer_peek_wait(client->message_ring, (void **)&out_msg, WAIT_MS);
+          out_msg = NULL;
+          // everything read has been acknowledged
+          if(rc == RING_BUFFER_CLOSED && (!client->spool || spool_queued(client->spool) == 0)) {
+            break;
           }
         }
-        
-        if(out_msg) {
-          client->current_message = out_msg;
-          client->published = 0;
-          client->working = 1;
-          rc = MQTTAsync_send(client->client, config->topic, msg->length, msg->body,
-                              config->qos, config->retained, &client->publish_opts);
-          if(rc != 0) {
-            fprintf(stderr, "Error sending message: %d\n", rc);
-          }
-          doing_work = 1;
+        client->publish_attempts = 0;
+      }
+      
+      if(out_msg) {
+        client->current_message = out_msg;
+        client->published = 0;
+        client->working = 1;
+        rc = MQTTAsync_send(client->client, config->topic, out_msg->length, out_msg->body,
+                            config->qos, config->retained, &client->publish_opts);
+        if(rc != 0) {
+          fprintf(stderr, "Error sending message: %d\n", rc);
         }
       }
+    } else {
+      if(client->connected == -1 && time(NULL) - client->last_connect >= RECONNECT_SECONDS) {
+        client->connected = 0;
+        mqtt_connect(client);
+      }
+      ring_buffer_wait(client->message_ring, WAIT_MS);
     }
     
-    if((client->working == 0) && (ring_buffer_available_data(client->message_ring) == 0) && (done_reading)) {
-      // we are done
-      break;
+    // only acknowledged messages count, the ring and the one in flight are
+    // published again after a restart
+    if(checkpoint && checkpoint_due(checkpoint)) {
+      if(checkpoint_save(checkpoint, __atomic_load_n(&client->published_offset, __ATOMIC_ACQUIRE)) != 0) {
+        fprintf(stderr, "Unable to save checkpoint: %s\n", config->checkpoint_file);
+      }
     }
-    
-    if(!doing_work) {
-      usleep(2000);
+  }
+  pthread_join(reader_thread, NULL);
+  free(reader.overflow);
+  spool_close(client->spool);
+  
+  if(checkpoint) {
+    if(checkpoint_save(checkpoint, __atomic_load_n(&client->published_offset, __ATOMIC_ACQUIRE)) != 0) {
+      fprintf(stderr, "Unable to save checkpoint: %s\n", config->checkpoint_file);
     }
+    checkpoint_close(checkpoint);
   }
   
   rc = MQTTAsync_disconnect(client->client, &client->disconnect_opts);
@@ -525,6 +836,7 @@ int main(int argc, char **argv)
   */
  	MQTTAsync_destroy(&client->client);
  	free(client);
+  ring_buffer_destroy(ring);
   
   ds_close_file(src);
 }
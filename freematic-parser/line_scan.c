@@ -0,0 +1,175 @@
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define LINE_SCAN_X86
+#endif
+
+#include "line_scan.h"
+
+typedef int (*line_scan_handler)(const char *buf, int len, int base, int *commas, 
+                                 int *comma_cnt, int max_commas, int *found,
+                                 unsigned char *xor_sum);
+
+// Scalar tail shared by all variants, also the whole scanner off x86.
+static int line_scan_scalar(const char *buf, int len, int base, int *commas, 
+                            int *comma_cnt, int max_commas, int *found,
+                            unsigned char *xor_sum)
+{
+  int idx, cnt = *comma_cnt;
+  unsigned char x = *xor_sum;
+  char c;
+  
+  *found = 0;
+  for(idx = 0; idx < len; idx++) {
+    c = buf[idx];
+    if(c == '\r' || c == '\n') {
+      *found = 1;
+      break;
+    }
+    if(c == ',') {
+      if(cnt == max_commas) {
+        break;
+      }
+      commas[cnt++] = base + idx;
+    }
+    x ^= (unsigned char)c;
+  }
+  *comma_cnt = cnt;
+  *xor_sum = x;
+  
+  return idx;
+}
+
+// Turn one block worth of masks into comma offsets.  Returns non zero 
+// when the block held a line end, which is then at *end.
+static inline int line_scan_masks(uint32_t newlines, uint32_t comma_mask, int base, 
+                                  int *commas, int *cnt, int *end)
+{
+  if(newlines) {
+    *end = __builtin_ctz(newlines);
+    comma_mask &= (1u << *end) - 1;
+  }
+  while(comma_mask) {
+    commas[(*cnt)++] = base + __builtin_ctz(comma_mask);
+    comma_mask &= comma_mask - 1;
+  }
+  return newlines != 0;
+}
+
+#ifdef LINE_SCAN_X86
+
+// fold the bytes of an xor accumulator into one
+static inline unsigned char line_scan_fold(__m128i acc)
+{
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+  return (unsigned char)_mm_cvtsi128_si32(acc);
+}
+
+// xor of the bytes in front of the line end in the last block
+static inline unsigned char line_scan_xor_tail(const char *buf, int len)
+{
+  unsigned char x = 0;
+  int idx;
+  
+  for(idx = 0; idx < len; idx++) {
+    x ^= (unsigned char)buf[idx];
+  }
+  return x;
+}
+
+static int line_scan_sse2(const char *buf, int len, int base, int *commas, 
+                          int *comma_cnt, int max_commas, int *found,
+                          unsigned char *xor_sum)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i comma = _mm_set1_epi8(',');
+  __m128i lo, hi, acc = _mm_setzero_si128();
+  uint32_t newlines, comma_mask;
+  int idx = 0, end, n;
+  
+  while(idx + LINE_SCAN_BLOCK <= len && max_commas - *comma_cnt >= LINE_SCAN_BLOCK) {
+    lo = _mm_loadu_si128((const __m128i *)(buf + idx));
+    hi = _mm_loadu_si128((const __m128i *)(buf + idx + 16));
+    newlines = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(lo, cr), _mm_cmpeq_epi8(lo, lf))) |
+               ((uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(hi, cr), _mm_cmpeq_epi8(hi, lf))) << 16);
+    comma_mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, comma)) |
+                 ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, comma)) << 16);
+    if(line_scan_masks(newlines, comma_mask, base + idx, commas, comma_cnt, &end)) {
+      *xor_sum ^= line_scan_fold(acc) ^ line_scan_xor_tail(buf + idx, end);
+      *found = 1;
+      return idx + end;
+    }
+    acc = _mm_xor_si128(acc, _mm_xor_si128(lo, hi));
+    idx += LINE_SCAN_BLOCK;
+  }
+  
+  *xor_sum ^= line_scan_fold(acc);
+  n = line_scan_scalar(buf + idx, len - idx, base + idx, commas, comma_cnt, max_commas, found, xor_sum);
+  return idx + n;
+}
+
+__attribute__((target("avx2")))
+static int line_scan_avx2(const char *buf, int len, int base, int *commas, 
+                          int *comma_cnt, int max_commas, int *found,
+                          unsigned char *xor_sum)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i comma = _mm256_set1_epi8(',');
+  __m256i block, acc = _mm256_setzero_si256();
+  uint32_t newlines, comma_mask;
+  int idx = 0, end, n;
+  
+  while(idx + LINE_SCAN_BLOCK <= len && max_commas - *comma_cnt >= LINE_SCAN_BLOCK) {
+    block = _mm256_loadu_si256((const __m256i *)(buf + idx));
+    newlines = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, cr), 
+                                                              _mm256_cmpeq_epi8(block, lf)));
+    comma_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, comma));
+    if(line_scan_masks(newlines, comma_mask, base + idx, commas, comma_cnt, &end)) {
+      *xor_sum ^= line_scan_fold(_mm_xor_si128(_mm256_castsi256_si128(acc), 
+                                               _mm256_extracti128_si256(acc, 1))) ^
+                  line_scan_xor_tail(buf + idx, end);
+      *found = 1;
+      return idx + end;
+    }
+    acc = _mm256_xor_si256(acc, block);
+    idx += LINE_SCAN_BLOCK;
+  }
+  
+  *xor_sum ^= line_scan_fold(_mm_xor_si128(_mm256_castsi256_si128(acc), 
+                                           _mm256_extracti128_si256(acc, 1)));
+  n = line_scan_scalar(buf + idx, len - idx, base + idx, commas, comma_cnt, max_commas, found, xor_sum);
+  return idx + n;
+}
+
+static line_scan_handler line_scan_impl = line_scan_sse2;
+
+void line_scan_init(void)
+{
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    line_scan_impl = line_scan_avx2;
+  }
+}
+
+#else
+
+static line_scan_handler line_scan_impl = line_scan_scalar;
+
+void line_scan_init(void)
+{
+}
+
+#endif /* LINE_SCAN_X86 */
+
+int line_scan(const char *buf, int len, int base, int *commas, int *comma_cnt, 
+              int max_commas, int *found, unsigned char *xor_sum)
+{
+  return (*line_scan_impl)(buf, len, base, commas, comma_cnt, max_commas, found, xor_sum);
+}
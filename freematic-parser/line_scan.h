@@ -0,0 +1,19 @@
+#ifndef _LINE_SCAN_H_
+#define _LINE_SCAN_H_
+
+// bytes examined per step, callers keep this many comma slots free
+#define LINE_SCAN_BLOCK 32
+
+// picks the widest scanner the cpu supports, call once before scanning
+void line_scan_init(void);
+
+// Scans buf[0..len) for the first '\r' or '\n'.  The offset (plus base) of 
+// every ',' before it is appended to commas at *comma_cnt.  Scanning stops 
+// early when fewer than LINE_SCAN_BLOCK slots are left free.  Every byte 
+// scanned is xor'ed into *xor_sum, which lets NMEA checksums be checked 
+// without another pass.  Returns the number of bytes scanned, *found is 
+// set when that is where a line ends.
+int line_scan(const char *buf, int len, int base, int *commas, int *comma_cnt, 
+              int max_commas, int *found, unsigned char *xor_sum);
+
+#endif /* _LINE_SCAN_H_ */
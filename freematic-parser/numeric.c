@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "numeric.h"
+
+// every power of ten a double holds exactly
+static const double numeric_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define NUMERIC_MAX_EXACT (1ULL << 53)
+
+// strtod on a terminated copy, for what the fast path can't round exactly
+static int numeric_parse_slow(const char *s, int len, double *value)
+{
+  char buffer[64];
+  char *end;
+  
+  if(len >= (int)sizeof(buffer)) {
+    return -1;
+  }
+  memcpy(buffer, s, len);
+  buffer[len] = 0;
+  *value = strtod(buffer, &end);
+  
+  return end == buffer + len ? 0 : -1;
+}
+
+// NMEA numbers have few digits, so the mantissa fits 53 bits and one 
+// division by an exact power of ten is correctly rounded.
+int numeric_parse(const char *s, int len, double *value)
+{
+  uint64_t mantissa = 0;
+  int idx = 0, digits = 0, fraction = -1, negative = 0, seen = 0;
+  double r;
+  
+  if(len <= 0) {
+    return -1;
+  }
+  if(s[0] == '-' || s[0] == '+') {
+    negative = s[0] == '-';
+    idx++;
+  }
+  for(; idx < len; idx++) {
+    if(s[idx] >= '0' && s[idx] <= '9') {
+      if(digits == 19) {
+        return numeric_parse_slow(s, len, value);
+      }
+      mantissa = mantissa * 10 + (s[idx] - '0');
+      seen = 1;
+      if(mantissa) {
+        digits++;
+      }
+      if(fraction >= 0) {
+        fraction++;
+      }
+    } else if(s[idx] == '.' && fraction < 0) {
+      fraction = 0;
+    } else {
+      return -1;
+    }
+  }
+  if(!seen) {
+    return -1;
+  }
+  if(fraction < 0) {
+    fraction = 0;
+  }
+  
+  if(mantissa > NUMERIC_MAX_EXACT || fraction > 22) {
+    return numeric_parse_slow(s, len, value);
+  }
+  r = (double)mantissa / numeric_pow10[fraction];
+  *value = negative ? -r : r;
+  
+  return 0;
+}
+
+// integral values without the printf round trip
+static int numeric_format_integer(int64_t v, char *buf, int len)
+{
+  char digits[24];
+  int n = 0, idx = 0;
+  uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+  
+  do {
+    digits[n++] = '0' + (u % 10);
+    u /= 10;
+  } while(u);
+  if(n + (v < 0) > len) {
+    return -1;
+  }
+  if(v < 0) {
+    buf[idx++] = '-';
+  }
+  while(n) {
+    buf[idx++] = digits[--n];
+  }
+  return idx;
+}
+
+int numeric_format(double value, char *buf, int len)
+{
+  char text[NUMERIC_LENGTH];
+  int precision, n = 0;
+  
+  if(value == 0) {
+    value = 0;  // no "-0"
+  }
+  if(value > -9007199254740992.0 && value < 9007199254740992.0 && value == (double)(int64_t)value) {
+    return numeric_format_integer((int64_t)value, buf, len);
+  }
+  
+  for(precision = 15; precision <= 17; precision++) {
+    n = snprintf(text, sizeof(text), "%.*g", precision, value);
+    if(strtod(text, NULL) == value) {
+      break;
+    }
+  }
+  if(n < 0 || n > len) {
+    return -1;
+  }
+  memcpy(buf, text, n);
+  
+  return n;
+}
@@ -0,0 +1,15 @@
+#ifndef _NUMERIC_H_
+#define _NUMERIC_H_
+
+// enough room for any double numeric_format writes
+#define NUMERIC_LENGTH 32
+
+// Parses [+-]digits[.digits] from s[0..len) into *value, independent of 
+// the locale.  Returns 0 on success, -1 when s is not a plain decimal.
+int numeric_parse(const char *s, int len, double *value);
+
+// Writes the shortest text that reads back as exactly value, no NUL.  
+// Returns the length written or -1 when len is too small.
+int numeric_format(double value, char *buf, int len);
+
+#endif /* _NUMERIC_H_ */
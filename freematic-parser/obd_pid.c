@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "obd_pid.h"
+
+#define OBD_MODE01(pid) (0x100 | (pid))
+
+// Indexed directly by pid.  The logger already decodes mode 01 values to 
+// engineering units, so most entries only name them.
+static const obd_pid_t obd_pids[OBD_PID_COUNT] = {
+  // Freematics specific
+  [0x0A] = { "gps_latitude", "deg", 1, 0 },
+  [0x0B] = { "gps_longitude", "deg", 1, 0 },
+  [0x0C] = { "gps_altitude", "m", 1, 0 },
+  [0x0D] = { "gps_speed", "km/h", 1, 0 },
+  [0x0E] = { "gps_heading", "deg", 1, 0 },
+  [0x0F] = { "gps_satellites", "", 1, 0 },
+  [0x10] = { "gps_time", "", 1, 0 },
+  [0x11] = { "gps_date", "", 1, 0 },
+  [OBD_PID_ACC] = { "accelerometer", "", 1, 0 },
+  [OBD_PID_GYRO] = { "gyroscope", "", 1, 0 },
+  [0x22] = { "compass", "", 1, 0 },
+  [0x23] = { "device_temperature", "C", 0.1, 0 },
+  [0x24] = { "battery_voltage", "V", 0.01, 0 },
+  
+  // mode 01
+  [OBD_MODE01(0x04)] = { "engine_load", "%", 1, 0 },
+  [OBD_MODE01(0x05)] = { "coolant_temperature", "C", 1, 0 },
+  [OBD_MODE01(0x06)] = { "short_term_fuel_trim_1", "%", 1, 0 },
+  [OBD_MODE01(0x07)] = { "long_term_fuel_trim_1", "%", 1, 0 },
+  [OBD_MODE01(0x08)] = { "short_term_fuel_trim_2", "%", 1, 0 },
+  [OBD_MODE01(0x09)] = { "long_term_fuel_trim_2", "%", 1, 0 },
+  [OBD_MODE01(0x0A)] = { "fuel_pressure", "kPa", 1, 0 },
+  [OBD_MODE01(0x0B)] = { "intake_manifold_pressure", "kPa", 1, 0 },
+  [OBD_MODE01(0x0C)] = { "engine_rpm", "rpm", 1, 0 },
+  [OBD_MODE01(0x0D)] = { "vehicle_speed", "km/h", 1, 0 },
+  [OBD_MODE01(0x0E)] = { "timing_advance", "deg", 1, 0 },
+  [OBD_MODE01(0x0F)] = { "intake_temperature", "C", 1, 0 },
+  [OBD_MODE01(0x10)] = { "maf_flow", "g/s", 1, 0 },
+  [OBD_MODE01(0x11)] = { "throttle_position", "%", 1, 0 },
+  [OBD_MODE01(0x1F)] = { "run_time", "s", 1, 0 },
+  [OBD_MODE01(0x21)] = { "distance_with_mil", "km", 1, 0 },
+  [OBD_MODE01(0x2C)] = { "commanded_egr", "%", 1, 0 },
+  [OBD_MODE01(0x2D)] = { "egr_error", "%", 1, 0 },
+  [OBD_MODE01(0x2F)] = { "fuel_level", "%", 1, 0 },
+  [OBD_MODE01(0x31)] = { "distance_since_codes_cleared", "km", 1, 0 },
+  [OBD_MODE01(0x33)] = { "barometric_pressure", "kPa", 1, 0 },
+  [OBD_MODE01(0x42)] = { "control_module_voltage", "V", 1, 0 },
+  [OBD_MODE01(0x43)] = { "absolute_engine_load", "%", 1, 0 },
+  [OBD_MODE01(0x44)] = { "commanded_air_fuel_ratio", "", 1, 0 },
+  [OBD_MODE01(0x45)] = { "relative_throttle_position", "%", 1, 0 },
+  [OBD_MODE01(0x46)] = { "ambient_temperature", "C", 1, 0 },
+  [OBD_MODE01(0x47)] = { "absolute_throttle_position_b", "%", 1, 0 },
+  [OBD_MODE01(0x49)] = { "accelerator_pedal_position_d", "%", 1, 0 },
+  [OBD_MODE01(0x4A)] = { "accelerator_pedal_position_e", "%", 1, 0 },
+  [OBD_MODE01(0x4C)] = { "commanded_throttle_actuator", "%", 1, 0 },
+  [OBD_MODE01(0x5A)] = { "relative_accelerator_pedal_position", "%", 1, 0 },
+  [OBD_MODE01(0x5B)] = { "hybrid_battery_life", "%", 1, 0 },
+  [OBD_MODE01(0x5C)] = { "engine_oil_temperature", "C", 1, 0 },
+  [OBD_MODE01(0x5D)] = { "fuel_injection_timing", "deg", 1, 0 },
+  [OBD_MODE01(0x5E)] = { "engine_fuel_rate", "L/h", 1, 0 },
+  [OBD_MODE01(0x61)] = { "driver_demand_torque", "%", 1, 0 },
+  [OBD_MODE01(0x62)] = { "actual_engine_torque", "%", 1, 0 },
+  [OBD_MODE01(0x63)] = { "engine_reference_torque", "Nm", 1, 0 },
+};
+
+int obd_pid_index(const char *pid, int len)
+{
+  int idx, value = 0;
+  char c;
+  
+  if(len <= 0 || len > 3) {
+    return -1;
+  }
+  for(idx = 0; idx < len; idx++) {
+    c = pid[idx];
+    if(c >= '0' && c <= '9') {
+      value = (value << 4) | (c - '0');
+    } else if(c >= 'A' && c <= 'F') {
+      value = (value << 4) | (c - 'A' + 10);
+    } else if(c >= 'a' && c <= 'f') {
+      value = (value << 4) | (c - 'a' + 10);
+    } else {
+      return -1;
+    }
+  }
+  
+  return value < OBD_PID_COUNT ? value : -1;
+}
+
+const obd_pid_t *obd_pid_entry(int idx)
+{
+  if(idx < 0 || idx >= OBD_PID_COUNT || obd_pids[idx].name == NULL) {
+    return NULL;
+  }
+  return &obd_pids[idx];
+}
@@ -0,0 +1,24 @@
+#ifndef _OBD_PID_H_
+#define _OBD_PID_H_
+
+// pids as the Freematics logger writes them, mode 01 pids are 0x100 | pid
+#define OBD_PID_COUNT 0x200
+
+#define OBD_PID_ACC   0x20
+#define OBD_PID_GYRO  0x21
+
+// value = raw * scale + offset, in unit
+typedef struct obd_pid_str {
+  char   *name;
+  char   *unit;
+  double scale;
+  double offset;
+} obd_pid_t;
+
+// Hex pid text to its table index, -1 when it isn't one.
+int obd_pid_index(const char *pid, int len);
+
+// Table entry for an index from obd_pid_index, NULL when unknown.
+const obd_pid_t *obd_pid_entry(int idx);
+
+#endif /* _OBD_PID_H_ */
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "output_buffer.h"
+
+output_buffer_t *output_buffer_create(long capacity, int fd)
+{
+  output_buffer_t *out = (output_buffer_t *)calloc(1, sizeof(output_buffer_t));
+  if(out) {
+    out->fd = fd;
+    out->capacity = capacity;
+    out->length = 0;
+    out->data = (char *)malloc(capacity);
+    if(!out->data) {
+      free(out);
+      out = NULL;
+    }
+  }
+  return out;
+}
+
+void output_buffer_destroy(output_buffer_t *out)
+{
+  if(out) {
+    if(out->data) {
+      free(out->data);
+    }
+    free(out);
+  }
+}
+
+int output_buffer_writev(int fd, struct iovec *iov, int count)
+{
+  ssize_t n;
+  
+  while(count > 0) {
+    n = writev(fd, iov, count);
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    
+    // skip what went out, resume part way into a partially written entry
+    while(count > 0 && n >= (ssize_t)iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if(count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  
+  return 0;
+}
+
+int output_buffer_flush(output_buffer_t *out)
+{
+  struct iovec iov;
+  
+  if(!out || out->fd < 0) {
+    return -1;
+  }
+  if(out->length > 0) {
+    iov.iov_base = out->data;
+    iov.iov_len = out->length;
+    if(output_buffer_writev(out->fd, &iov, 1) != 0) {
+      return -1;
+    }
+    out->length = 0;
+  }
+  return 0;
+}
+
+char *output_buffer_reserve(output_buffer_t *out, long len)
+{
+  long capacity;
+  char *ptr;
+  
+  if(out->length + len > out->capacity) {
+    if(out->fd >= 0) {
+      if(output_buffer_flush(out) != 0) {
+        return NULL;
+      }
+    }
+    
+    // in memory buffers, and records bigger than the whole arena, grow
+    if(out->length + len > out->capacity) {
+      capacity = out->capacity ? out->capacity : 4096;
+      while(out->length + len > capacity) {
+        capacity *= 2;
+      }
+      ptr = (char *)realloc(out->data, capacity);
+      if(!ptr) {
+        return NULL;
+      }
+      out->data = ptr;
+      out->capacity = capacity;
+    }
+  }
+  
+  return out->data + out->length;
+}
+
+void output_buffer_commit(output_buffer_t *out, long len)
+{
+  out->length += len;
+}
+
+int output_buffer_append(output_buffer_t *out, char *data, long len)
+{
+  char *ptr = output_buffer_reserve(out, len);
+  if(!ptr) {
+    return -1;
+  }
+  memcpy(ptr, data, len);
+  output_buffer_commit(out, len);
+  return 0;
+}
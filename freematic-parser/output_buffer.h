@@ -0,0 +1,28 @@
+#ifndef _OUTPUT_BUFFER_H_
+#define _OUTPUT_BUFFER_H_
+
+#include <sys/uio.h>
+
+// Reusable output arena.  Records are rendered straight into it and it is
+// written to fd with a single write when full.  With fd < 0 it grows in 
+// memory instead and the owner decides where the bytes go.
+typedef struct output_buffer_str {
+  char *data;
+  long length;
+  long capacity;
+  int  fd;
+} output_buffer_t;
+
+output_buffer_t *output_buffer_create(long capacity, int fd);
+void output_buffer_destroy(output_buffer_t *out);
+
+// room for len bytes at the returned pointer, NULL when it can't be had
+char *output_buffer_reserve(output_buffer_t *out, long len);
+void output_buffer_commit(output_buffer_t *out, long len);
+int output_buffer_append(output_buffer_t *out, char *data, long len);
+int output_buffer_flush(output_buffer_t *out);
+
+// writev that copes with partial writes
+int output_buffer_writev(int fd, struct iovec *iov, int count);
+
+#endif /* _OUTPUT_BUFFER_H_ */
@@ -1,38 +1,239 @@
 #include <stdlib.h>
 #include <stdint.h>
-#include <pthread.h>
+#include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "ring_buffer.h"
 
+#define RING_BUFFER_CACHE_LINE 64
+
+// Single producer, single consumer.  head and tail only ever grow and are
+// masked into the slots, each is written by one side and published with
+// a release store.  Both sides keep a cached copy of the other's index so
+// the shared line is only read when the ring looks full or empty.
 struct ring_buffer_str {
-  void    **buffer;
-  int32_t count;
-  int32_t size;
-  int32_t head;
-  int32_t tail;
+  // producer
+  uint32_t head __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+  uint32_t tail_cache;
+  
+  // consumer
+  uint32_t tail __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+  uint32_t head_cache;
+  
+  // fixed at create
+  void     **buffer __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+  uint32_t capacity;
+  uint32_t mask;
   
   // data handling functions
   ring_buffer_data_delete_handler delete_handler;
   
-  // mutex
-  pthread_mutex_t mutex;
+  // inline slots of ring_buffer_create_slots
+  char     *slots;
+  size_t   slot_length;
+  
+  // blocking callers, the lock free paths only take the lock when
+  // waiters says someone is asleep
+  pthread_mutex_t lock __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+  pthread_cond_t  changed;
+  int      waiters;
+  int      closed;
+  int      notified;
 };
 
+// Wakes anyone blocked on the ring after head or tail moved.
+static void ring_buffer_wake(ring_buffer_t *ring)
+{
+  // pairs with the waiter raising waiters before it looks at head and tail
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&ring->waiters, __ATOMIC_RELAXED) > 0) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+// Free entries as the producer sees them, only reloads tail when full.
+static uint32_t ring_buffer_room(ring_buffer_t *ring)
+{
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  
+  if(head - ring->tail_cache == ring->capacity) {
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  }
+  return ring->capacity - (head - ring->tail_cache);
+}
+
+// Queued entries as the consumer sees them, only reloads head when empty.
+static uint32_t ring_buffer_queued(ring_buffer_t *ring)
+{
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  
+  if(tail == ring->head_cache) {
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  }
+  return ring->head_cache - tail;
+}
+
+static int ring_buffer_put(ring_buffer_t *ring, void *data)
+{
+  uint32_t head;
+  
+  if(ring_buffer_room(ring) == 0) {
+    return -1;
+  }
+  head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  ring->buffer[head & ring->mask] = data;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  
+  return 0;
+}
+
+static void *ring_buffer_take(ring_buffer_t *ring)
+{
+  uint32_t tail;
+  void *result;
+  
+  if(ring_buffer_queued(ring) == 0) {
+    return NULL;
+  }
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  result = ring->buffer[tail & ring->mask];
+  ring->buffer[tail & ring->mask] = NULL;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  
+  return result;
+}
+
+static char *ring_buffer_slot(ring_buffer_t *ring, uint32_t index)
+{
+  return ring->slots + (size_t)(index & ring->mask) * ring->slot_length;
+}
+
+static void ring_buffer_deadline(struct timespec *deadline, int timeout_ms)
+{
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if(deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+// With the lock held, a negative timeout waits for ever.
+static int ring_buffer_sleep(ring_buffer_t *ring, int timeout_ms, struct timespec *deadline)
+{
+  if(timeout_ms < 0) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+    return 0;
+  }
+  return pthread_cond_timedwait(&ring->changed, &ring->lock, deadline) == ETIMEDOUT ? -1 : 0;
+}
+
+// Sleeps until the producer has room or the consumer has an entry.  The
+// consumer also comes back after a notify, and once the ring is closed
+// and empty.  Nothing is moved, the caller does that after RING_BUFFER_OK.
+static int ring_buffer_block(ring_buffer_t *ring, int consumer, int timeout_ms)
+{
+  struct timespec deadline;
+  int rc;
+  
+  if(timeout_ms >= 0) {
+    ring_buffer_deadline(&deadline, timeout_ms);
+  }
+  pthread_mutex_lock(&ring->lock);
+  __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+  while(1) {
+    if(consumer) {
+      if(ring_buffer_queued(ring) > 0) {
+        rc = RING_BUFFER_OK;
+        break;
+      }
+      if(ring->notified) {
+        ring->notified = 0;
+        rc = RING_BUFFER_NOTIFIED;
+        break;
+      }
+      if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+        // the last write can land between the check above and the close
+        rc = ring_buffer_queued(ring) > 0 ? RING_BUFFER_OK : RING_BUFFER_CLOSED;
+        break;
+      }
+    } else {
+      if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+        rc = RING_BUFFER_CLOSED;
+        break;
+      }
+      if(ring_buffer_room(ring) > 0) {
+        rc = RING_BUFFER_OK;
+        break;
+      }
+    }
+    if(ring_buffer_sleep(ring, timeout_ms, &deadline) != 0) {
+      rc = RING_BUFFER_TIMEDOUT;
+      break;
+    }
+  }
+  __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&ring->lock);
+  
+  return rc;
+}
+
 ring_buffer_t *ring_buffer_create(int size)
 {
-  ring_buffer_t *ring = (ring_buffer_t *)calloc(1, sizeof(ring_buffer_t));
+  ring_buffer_t *ring = NULL;
+  pthread_condattr_t attr;
+  uint32_t capacity = 1;
+  
+  if(size <= 0 || size > (1 << 30)) {
+    return NULL;
+  }
+  // rounded up to a power of two
+  while(capacity < (uint32_t)size) {
+    capacity <<= 1;
+  }
+  
+  if(posix_memalign((void **)&ring, RING_BUFFER_CACHE_LINE, sizeof(ring_buffer_t)) != 0) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(ring_buffer_t));
+  ring->capacity = capacity;
+  ring->mask = capacity - 1;
+  
+  // timed waits run on the monotonic clock, setting the time doesn't stretch them
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ring->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  
+  ring->buffer = (void **)calloc(capacity, sizeof(void *));
+  if(!ring->buffer) {
+    ring_buffer_destroy(ring);
+    ring = NULL;
+  }
+  return ring;
+}
+
+ring_buffer_t *ring_buffer_create_slots(int size, int slot_length)
+{
+  ring_buffer_t *ring;
+  
+  if(slot_length <= 0) {
+    return NULL;
+  }
+  ring = ring_buffer_create(size);
   if(ring) {
-    pthread_mutexattr_t mattr;
-    pthread_mutexattr_init(&mattr);
-    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&ring->mutex, &mattr);    
-    
-    ring->count = 0;
-    ring->size = size;
-    ring->head = ring->tail = 0;
-    ring->buffer = (void **)calloc(size, sizeof(void *));
-    if(!ring->buffer) {
+    // keeps every slot aligned for the header the caller puts in front
+    ring->slot_length = ((size_t)slot_length + 15) & ~(size_t)15;
+    if(posix_memalign((void **)&ring->slots, RING_BUFFER_CACHE_LINE,
+                      ring->capacity * ring->slot_length) != 0) {
+      ring->slots = NULL;
       ring_buffer_destroy(ring);
       ring = NULL;
     }
@@ -42,107 +243,276 @@ ring_buffer_t *ring_buffer_create(int size)
 
 void ring_buffer_destroy(ring_buffer_t *ring)
 {
-  int i = 0;
+  uint32_t i;
+  
   if(ring) {
     if(ring->buffer) {
       if(ring->delete_handler) {
-        for(i = 0; i < ring->size; i++) {
-          if(ring->buffer[i]) {
-            (*ring->delete_handler)(ring->buffer[i]);
-            ring->buffer[i] = NULL;
+        for(i = ring->tail; i != ring->head; i++) {
+          if(ring->buffer[i & ring->mask]) {
+            (*ring->delete_handler)(ring->buffer[i & ring->mask]);
+            ring->buffer[i & ring->mask] = NULL;
           }
         }
       }
       free(ring->buffer);
     }
-    pthread_mutex_destroy(&ring->mutex);
+    if(ring->slots) {
+      free(ring->slots);
+    }
+    pthread_cond_destroy(&ring->changed);
+    pthread_mutex_destroy(&ring->lock);
     free(ring);
   }
 }
 
 int ring_buffer_available_data(ring_buffer_t *ring)
 {
-  int result = -1;
+  if(!ring) {
+    return -1;
+  }
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+int ring_buffer_available_slots(ring_buffer_t *ring)
+{
+  if(!ring) {
+    return -1;
+  }
+  return ring->capacity - (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+                           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+// producer side only
+int ring_buffer_write(ring_buffer_t *ring, void *data)
+{
+  if(!ring || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  if(ring_buffer_put(ring, data) != 0) {
+    return -1;
+  }
+  ring_buffer_wake(ring);
   
-  if(ring) {
-    if(pthread_mutex_trylock(&ring->mutex) != 0) {
-      return 0;
-    }
-    
-    result = ring->count;
+  return 0;
+}
 
-    pthread_mutex_unlock(&ring->mutex);
+// consumer side only
+void *ring_buffer_read(ring_buffer_t *ring)
+{
+  void *result;
+  
+  if(!ring) {
+    return NULL;
+  }
+  result = ring_buffer_take(ring);
+  if(result) {
+    ring_buffer_wake(ring);
   }
   
   return result;
 }
 
-int ring_buffer_available_slots(ring_buffer_t *ring)
+int ring_buffer_write_wait(ring_buffer_t *ring, void *data, int timeout_ms)
 {
-  int result = -1;
+  int rc;
   
-  if(ring) {
-    if(pthread_mutex_trylock(&ring->mutex) != 0) {
-      return 0;
+  if(!ring) {
+    return -1;
+  }
+  if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+    return RING_BUFFER_CLOSED;
+  }
+  if(ring_buffer_put(ring, data) != 0) {
+    rc = ring_buffer_block(ring, 0, timeout_ms);
+    if(rc != RING_BUFFER_OK) {
+      return rc;
     }
-    
-    result = ring->size - ring->count;    
+    ring_buffer_put(ring, data);
+  }
+  ring_buffer_wake(ring);
+  
+  return RING_BUFFER_OK;
+}
 
-    pthread_mutex_unlock(&ring->mutex);
+int ring_buffer_read_wait(ring_buffer_t *ring, void **data, int timeout_ms)
+{
+  int rc;
+  
+  if(!ring || !data) {
+    return -1;
+  }
+  if((*data = ring_buffer_take(ring)) == NULL) {
+    rc = ring_buffer_block(ring, 1, timeout_ms);
+    if(rc != RING_BUFFER_OK) {
+      return rc;
+    }
+    *data = ring_buffer_take(ring);
   }
+  ring_buffer_wake(ring);
   
-  return result;
+  return RING_BUFFER_OK;
 }
 
-int ring_buffer_write(ring_buffer_t *ring, void *data)
+// producer side of a slot ring
+void *ring_buffer_reserve(ring_buffer_t *ring)
+{
+  if(!ring || !ring->slots || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) ||
+     ring_buffer_room(ring) == 0) {
+    return NULL;
+  }
+  return ring_buffer_slot(ring, __atomic_load_n(&ring->head, __ATOMIC_RELAXED));
+}
+
+int ring_buffer_reserve_wait(ring_buffer_t *ring, void **slot, int timeout_ms)
 {
-  int result = -1;
+  int rc;
   
-  if(ring) {
-    if(pthread_mutex_lock(&ring->mutex) != 0) {
-      return -1;
+  if(!ring || !ring->slots || !slot) {
+    return -1;
+  }
+  if((*slot = ring_buffer_reserve(ring)) == NULL) {
+    rc = ring_buffer_block(ring, 0, timeout_ms);
+    if(rc != RING_BUFFER_OK) {
+      return rc;
     }
+    *slot = ring_buffer_reserve(ring);
+  }
+  
+  return RING_BUFFER_OK;
+}
 
-    if(ring_buffer_available_slots(ring) > 0) {
-      ring->buffer[ring->head++] = data;
-      if(ring->head == ring->size) {
-        ring->head = 0;
-      }
-      ring->count++;
-      result = 0;
+void ring_buffer_commit(ring_buffer_t *ring)
+{
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  ring_buffer_wake(ring);
+}
+
+// consumer side of a slot ring
+void *ring_buffer_peek(ring_buffer_t *ring)
+{
+  if(!ring || !ring->slots || ring_buffer_queued(ring) == 0) {
+    return NULL;
+  }
+  return ring_buffer_slot(ring, __atomic_load_n(&ring->tail, __ATOMIC_RELAXED));
+}
+
+int ring_buffer_peek_wait(ring_buffer_t *ring, void **slot, int timeout_ms)
+{
+  int rc;
+  
+  if(!ring || !ring->slots || !slot) {
+    return -1;
+  }
+  if((*slot = ring_buffer_peek(ring)) == NULL) {
+    rc = ring_buffer_block(ring, 1, timeout_ms);
+    if(rc != RING_BUFFER_OK) {
+      return rc;
     }
+    *slot = ring_buffer_peek(ring);
+  }
+  
+  return RING_BUFFER_OK;
+}
 
-    pthread_mutex_unlock(&ring->mutex);
+void ring_buffer_release(ring_buffer_t *ring)
+{
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  ring_buffer_wake(ring);
+}
+
+// Looks at up to count of the oldest slots with a single acquire of head.
+int ring_buffer_peek_many(ring_buffer_t *ring, void **slots, int count)
+{
+  uint32_t tail, queued;
+  int i;
+  
+  if(!ring || !ring->slots || !slots || count < 0) {
+    return -1;
   }
   
-  return result;
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  queued = ring->head_cache - tail;
+  if(queued < (uint32_t)count) {
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    queued = ring->head_cache - tail;
+  }
+  if((uint32_t)count > queued) {
+    count = queued;
+  }
+  for(i = 0; i < count; i++) {
+    slots[i] = ring_buffer_slot(ring, tail + i);
+  }
+  
+  return count;
 }
 
-void *ring_buffer_read(ring_buffer_t *ring)
+// Hands back count slots with a single release of tail.
+void ring_buffer_release_many(ring_buffer_t *ring, int count)
 {
-  void *result = NULL;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
   
-  if(ring) {
-    if(pthread_mutex_trylock(&ring->mutex) != 0) {
-      return NULL;
-    }
+  if(count > 0) {
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    ring_buffer_wake(ring);
+  }
+}
 
-    if(ring_buffer_available_data(ring)) {
-      result = ring->buffer[ring->tail];
-      ring->buffer[ring->tail++] = NULL;
-      if(ring->tail == ring->size) {
-        ring->tail = 0;
-      }
-      ring->count--;
-    }
+int ring_buffer_wait(ring_buffer_t *ring, int timeout_ms)
+{
+  struct timespec deadline;
+  int rc = RING_BUFFER_NOTIFIED;
   
-    pthread_mutex_unlock(&ring->mutex);
+  if(!ring) {
+    return -1;
+  }
+  if(timeout_ms >= 0) {
+    ring_buffer_deadline(&deadline, timeout_ms);
+  }
+  pthread_mutex_lock(&ring->lock);
+  while(!ring->notified) {
+    if(ring_buffer_sleep(ring, timeout_ms, &deadline) != 0) {
+      rc = RING_BUFFER_TIMEDOUT;
+      break;
+    }
   }
+  ring->notified = 0;
+  pthread_mutex_unlock(&ring->lock);
   
-  return result;
+  return rc;
+}
+
+void ring_buffer_notify(ring_buffer_t *ring)
+{
+  if(ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->notified = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+void ring_buffer_close(ring_buffer_t *ring)
+{
+  if(ring) {
+    pthread_mutex_lock(&ring->lock);
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+int ring_buffer_closed(ring_buffer_t *ring)
+{
+  return !ring || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
 }
 
-void ring_buffer_set_data_delete_method(ring_buffer_t *ring, 
+void ring_buffer_set_data_delete_method(ring_buffer_t *ring,
                                         ring_buffer_data_delete_handler handler)
 {
   if(ring) {
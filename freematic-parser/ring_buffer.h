@@ -5,6 +5,14 @@ typedef struct ring_buffer_str ring_buffer_t;
 
 typedef void (*ring_buffer_data_delete_handler)(void *data);
 
+// results of the waiting calls
+#define RING_BUFFER_OK         0
+#define RING_BUFFER_TIMEDOUT   1
+#define RING_BUFFER_NOTIFIED   2
+#define RING_BUFFER_CLOSED    -2
+
+// One thread writes and one thread reads, without locks.  size is
+// rounded up to a power of two.
 ring_buffer_t *ring_buffer_create(int size);
 void ring_buffer_destroy(ring_buffer_t *ring);
 void *ring_buffer_read(ring_buffer_t *ring);
@@ -12,6 +20,38 @@ int ring_buffer_write(ring_buffer_t *ring, void *data);
 int ring_buffer_available_data(ring_buffer_t *ring);
 int ring_buffer_available_slots(ring_buffer_t *ring);
 
+// Blocking versions, a negative timeout waits for ever.  Writes fail with
+// RING_BUFFER_CLOSED once the ring is closed, reads carry on until it is
+// empty.  A read also returns RING_BUFFER_NOTIFIED after a notify.
+int ring_buffer_write_wait(ring_buffer_t *ring, void *data, int timeout_ms);
+int ring_buffer_read_wait(ring_buffer_t *ring, void **data, int timeout_ms);
+
+// A ring of size preallocated slots of slot_length bytes each, moved
+// without copying a pointer.  The producer fills the slot reserve returns
+// and commits it, the consumer peeks at the oldest and releases it when
+// done.  reserve and peek return NULL when the ring is full or empty, the
+// waiting versions return as the pointer rings do.
+ring_buffer_t *ring_buffer_create_slots(int size, int slot_length);
+void *ring_buffer_reserve(ring_buffer_t *ring);
+int ring_buffer_reserve_wait(ring_buffer_t *ring, void **slot, int timeout_ms);
+void ring_buffer_commit(ring_buffer_t *ring);
+void *ring_buffer_peek(ring_buffer_t *ring);
+int ring_buffer_peek_wait(ring_buffer_t *ring, void **slot, int timeout_ms);
+void ring_buffer_release(ring_buffer_t *ring);
+
+// The consumer can take a burst, up to count of the oldest slots oldest
+// first, 0 when the ring is empty, and release them together when done.
+int ring_buffer_peek_many(ring_buffer_t *ring, void **slots, int count);
+void ring_buffer_release_many(ring_buffer_t *ring, int count);
+
+// Sleeps until another thread calls notify, e.g. from a callback.
+int ring_buffer_wait(ring_buffer_t *ring, int timeout_ms);
+void ring_buffer_notify(ring_buffer_t *ring);
+
+// End of stream, wakes everyone waiting.
+void ring_buffer_close(ring_buffer_t *ring);
+int ring_buffer_closed(ring_buffer_t *ring);
+
 void ring_buffer_set_data_delete_method(ring_buffer_t *ring, ring_buffer_data_delete_handler handler);
 
 #endif /* _SIMPLE_RING_BUFFER_H_ */
\ No newline at end of file
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+
+#define SPOOL_HEADER  8             // length, then 1 once released
+#define SPOOL_END     0xffffffffU   // the rest of the segment is unused
+#define SPOOL_SUFFIX  ".spool"
+
+#define SPOOL_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static char *spool_path(spool_t *spool, uint32_t sequence)
+{
+  char *path = (char *)malloc(strlen(spool->directory) + 16 + sizeof(SPOOL_SUFFIX));
+  if(path) {
+    sprintf(path, "%s/%08x%s", spool->directory, sequence, SPOOL_SUFFIX);
+  }
+  return path;
+}
+
+// Maps a segment, a new one for writing is grown to segment_length and
+// reads back as zeros.  *length is the mapped size.  Reading maps it
+// writable too, to mark what has been released.
+//
+// The blocks of a new segment are allocated up front, a sparse file would
+// turn a full disk into SIGBUS on the first store through the mapping.
+static char *spool_map(spool_t *spool, uint32_t sequence, int writing, size_t *length)
+{
+  struct stat st;
+  char *path, *map = NULL;
+  int fd;
+  
+  path = spool_path(spool, sequence);
+  if(!path) {
+    return NULL;
+  }
+  fd = open(path, writing ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+  if(fd < 0) {
+    free(path);
+    return NULL;
+  }
+  if(writing) {
+    if((errno = posix_fallocate(fd, 0, spool->segment_length)) != 0) {
+      close(fd);
+      unlink(path);
+      free(path);
+      return NULL;
+    }
+    *length = spool->segment_length;
+  } else {
+    if(fstat(fd, &st) != 0 || st.st_size < SPOOL_HEADER) {
+      close(fd);
+      free(path);
+      return NULL;
+    }
+    *length = st.st_size;
+  }
+  free(path);
+  map = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  
+  return map == MAP_FAILED ? NULL : map;
+}
+
+static void spool_remove(spool_t *spool, uint32_t sequence)
+{
+  char *path = spool_path(spool, sequence);
+  if(path) {
+    unlink(path);
+    free(path);
+  }
+}
+
+// Records in a segment left by an earlier run that were never released,
+// up to the first cut short.
+static uint64_t spool_count(spool_t *spool, uint32_t sequence)
+{
+  uint64_t count = 0;
+  size_t length, position = 0;
+  uint32_t record, released;
+  char *map;
+  
+  map = spool_map(spool, sequence, 0, &length);
+  if(!map) {
+    return 0;
+  }
+  while(length - position >= SPOOL_HEADER) {
+    memcpy(&record, map + position, sizeof(record));
+    if(record == 0 || record == SPOOL_END || SPOOL_HEADER + SPOOL_ALIGN(record) > length - position) {
+      break;
+    }
+    memcpy(&released, map + position + 4, sizeof(released));
+    position += SPOOL_HEADER + SPOOL_ALIGN(record);
+    if(!released) {
+      count++;
+    }
+  }
+  munmap(map, length);
+  
+  return count;
+}
+
+// Finds the segments already in the directory, queues or deletes them.
+static int spool_recover(spool_t *spool, int keep)
+{
+  struct dirent *entry;
+  unsigned int sequence;
+  uint32_t first = 0, last = 0;
+  int found = 0;
+  char tail[sizeof(SPOOL_SUFFIX) + 1];
+  DIR *dir;
+  
+  dir = opendir(spool->directory);
+  if(!dir) {
+    return -1;
+  }
+  while((entry = readdir(dir)) != NULL) {
+    if(strlen(entry->d_name) != 8 + strlen(SPOOL_SUFFIX) ||
+       sscanf(entry->d_name, "%8x%7s", &sequence, tail) != 2 || strcmp(tail, SPOOL_SUFFIX) != 0) {
+      continue;
+    }
+    if(!keep) {
+      spool_remove(spool, sequence);
+      continue;
+    }
+    if(!found || sequence < first) {
+      first = sequence;
+    }
+    if(!found || sequence > last) {
+      last = sequence;
+    }
+    found = 1;
+  }
+  closedir(dir);
+  
+  if(found) {
+    spool->read_sequence = first;
+    for(sequence = first; sequence != last + 1; sequence++) {
+      spool->appended += spool_count(spool, sequence);
+    }
+    // appending carries on in a fresh segment
+    spool->write_sequence = last + 1;
+  }
+  return 0;
+}
+
+spool_t *spool_open(const char *directory, size_t segment_length, int keep)
+{
+  spool_t *spool = (spool_t *)calloc(1, sizeof(spool_t));
+  
+  if(spool) {
+    spool->directory = strdup(directory);
+    spool->segment_length = segment_length > 0 ? segment_length : SPOOL_SEGMENT_LENGTH;
+    if(!spool->directory || (mkdir(directory, 0755) != 0 && errno != EEXIST) ||
+       spool_recover(spool, keep) != 0) {
+      spool_close(spool);
+      spool = NULL;
+    }
+  }
+  return spool;
+}
+
+void spool_close(spool_t *spool)
+{
+  uint32_t sequence;
+  
+  if(spool) {
+    if(spool->write_map) {
+      munmap(spool->write_map, spool->segment_length);
+    }
+    if(spool->read_map) {
+      munmap(spool->read_map, spool->read_length);
+    }
+    // nothing left to replay, no reason to keep the files
+    if(spool->directory && spool_queued(spool) == 0) {
+      for(sequence = spool->read_sequence; sequence != spool->write_sequence + 1; sequence++) {
+        spool_remove(spool, sequence);
+      }
+    }
+    if(spool->directory) {
+      free(spool->directory);
+    }
+    free(spool);
+  }
+}
+
+int spool_append(spool_t *spool, const void *head, size_t head_length,
+                 const void *body, size_t body_length)
+{
+  size_t length = head_length + body_length;
+  size_t needed = SPOOL_HEADER + SPOOL_ALIGN(length);
+  size_t mapped;
+  char *next, *record;
+  
+  if(length == 0 || length >= SPOOL_END || needed > spool->segment_length) {
+    return -1;
+  }
+  
+  if(!spool->write_map || spool->segment_length - spool->write_position < needed) {
+    if(spool->write_map) {
+      // the next segment has to exist before the end marker sends the
+      // reader there
+      next = spool_map(spool, spool->write_sequence + 1, 1, &mapped);
+      if(!next) {
+        return -1;
+      }
+      if(spool->segment_length - spool->write_position >= SPOOL_HEADER) {
+        __atomic_store_n((uint32_t *)(spool->write_map + spool->write_position), SPOOL_END,
+                         __ATOMIC_RELEASE);
+      }
+      munmap(spool->write_map, spool->segment_length);
+      __atomic_store_n(&spool->write_sequence, spool->write_sequence + 1, __ATOMIC_RELEASE);
+    } else {
+      next = spool_map(spool, spool->write_sequence, 1, &mapped);
+      if(!next) {
+        return -1;
+      }
+    }
+    spool->write_map = next;
+    spool->write_position = 0;
+  }
+  
+  record = spool->write_map + spool->write_position;
+  memcpy(record + SPOOL_HEADER, head, head_length);
+  if(body_length > 0) {
+    memcpy(record + SPOOL_HEADER + head_length, body, body_length);
+  }
+  // the length goes in last, a record cut short reads as zero
+  __atomic_store_n((uint32_t *)record, (uint32_t)length, __ATOMIC_RELEASE);
+  spool->write_position += needed;
+  __atomic_add_fetch(&spool->appended, 1, __ATOMIC_RELEASE);
+  
+  return 0;
+}
+
+uint64_t spool_queued(spool_t *spool)
+{
+  return __atomic_load_n(&spool->appended, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&spool->released, __ATOMIC_ACQUIRE);
+}
+
+// Records counted as appended that are not on disk any more, a segment
+// removed or cut short under the spool.  They are given up on so the
+// count drains.
+static void *spool_lose(spool_t *spool, uint64_t appended)
+{
+  spool->lost += appended - spool->released;
+  __atomic_store_n(&spool->released, appended, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void *spool_peek(spool_t *spool, uint32_t *length)
+{
+  uint64_t appended = __atomic_load_n(&spool->appended, __ATOMIC_ACQUIRE);
+  uint32_t record;
+  
+  if(appended == spool->released) {
+    return NULL;
+  }
+  while(1) {
+    if(!spool->read_map) {
+      spool->read_map = spool_map(spool, spool->read_sequence, 0, &spool->read_length);
+      spool->read_position = 0;
+      if(!spool->read_map) {
+        // a segment lost from an earlier run, the records are further on
+        if(spool->read_sequence == __atomic_load_n(&spool->write_sequence, __ATOMIC_ACQUIRE)) {
+          return spool_lose(spool, appended);
+        }
+        spool->read_sequence++;
+        continue;
+      }
+    }
+    if(spool->read_length - spool->read_position >= SPOOL_HEADER) {
+      record = __atomic_load_n((uint32_t *)(spool->read_map + spool->read_position), __ATOMIC_ACQUIRE);
+      if(record != 0 && record != SPOOL_END &&
+         SPOOL_HEADER + SPOOL_ALIGN(record) <= spool->read_length - spool->read_position) {
+        // released before a restart
+        if(*(uint32_t *)(spool->read_map + spool->read_position + 4)) {
+          spool->read_position += SPOOL_HEADER + SPOOL_ALIGN(record);
+          continue;
+        }
+        *length = record;
+        return spool->read_map + spool->read_position + SPOOL_HEADER;
+      }
+    }
+  
+    // everything in this segment has been taken, the one still appended
+    // to is left to the writer
+    if(spool->read_sequence == __atomic_load_n(&spool->write_sequence, __ATOMIC_ACQUIRE)) {
+      return spool_lose(spool, appended);
+    }
+    munmap(spool->read_map, spool->read_length);
+    spool->read_map = NULL;
+    spool_remove(spool, spool->read_sequence);
+    spool->read_sequence++;
+  }
+}
+
+void spool_release(spool_t *spool)
+{
+  uint32_t record;
+  
+  memcpy(&record, spool->read_map + spool->read_position, sizeof(record));
+  *(uint32_t *)(spool->read_map + spool->read_position + 4) = 1;
+  spool->read_position += SPOOL_HEADER + SPOOL_ALIGN(record);
+  __atomic_add_fetch(&spool->released, 1, __ATOMIC_RELEASE);
+}
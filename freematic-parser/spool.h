@@ -0,0 +1,62 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// default size of one segment file
+#define SPOOL_SEGMENT_LENGTH (4 * 1024 * 1024)
+
+// Overflow queue on local disk, one thread appends and one thread takes
+// records from the front.  Records go into fixed size segment files
+// named by sequence number, each mapped only while it is written or
+// read, so memory stays at two segments however long the backlog.  A
+// drained segment is deleted.
+//
+// Every record has an 8 byte header whose length is stored last, a crash
+// leaves a zero length where a record was cut short and the rest of that
+// segment is ignored when the spool is opened again.  Released records
+// are marked in their header and not queued again.
+typedef struct spool_str {
+  char     *directory;
+  size_t   segment_length;
+  
+  // appending side
+  uint32_t write_sequence;
+  char     *write_map;
+  size_t   write_position;
+  
+  // taking side
+  uint32_t read_sequence;
+  char     *read_map;
+  size_t   read_length;
+  size_t   read_position;
+  
+  // records in the spool, bumped by each side as it goes
+  uint64_t appended;
+  uint64_t released;
+  uint64_t lost;          // counted but missing from disk, see spool_peek
+} spool_t;
+
+// Opens or creates the spool in directory.  With keep the records left
+// by an earlier run are queued first, otherwise they are thrown away.
+spool_t *spool_open(const char *directory, size_t segment_length, int keep);
+
+// Unmaps the segments, what has not been taken stays on disk.
+void spool_close(spool_t *spool);
+
+// Appends head then body as one record.  -1 when the record can't be
+// written, e.g. the disk is full or it is longer than a segment.
+int spool_append(spool_t *spool, const void *head, size_t head_length,
+                 const void *body, size_t body_length);
+
+// Records appended and not yet released.
+uint64_t spool_queued(spool_t *spool);
+
+// The oldest record, 8 byte aligned, and its length.  It stays put until
+// spool_release, NULL when the spool is empty.  Records that can't be
+// found are added to lost and no longer queued.
+void *spool_peek(spool_t *spool, uint32_t *length);
+void spool_release(spool_t *spool);
+
+#endif /* _SPOOL_H_ */
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "time_index.h"
+#include "output_buffer.h"
+#include "checkpoint.h"
+
+#define TIME_INDEX_OUTPUT_LENGTH (256 * 1024)
+
+time_index_writer_t *time_index_writer_create(int every)
+{
+  time_index_writer_t *w = (time_index_writer_t *)calloc(1, sizeof(time_index_writer_t));
+  if(w) {
+    w->every = every > 0 ? every : TIME_INDEX_EVERY;
+    w->monotonic = 1;
+  }
+  return w;
+}
+
+void time_index_writer_destroy(time_index_writer_t *w)
+{
+  if(w) {
+    free(w->entries);
+    free(w->anchors);
+    free(w);
+  }
+}
+
+int time_index_writer_line(time_index_writer_t *w, int64_t time_delta, uint64_t offset)
+{
+  if(w->lines > 0 && time_delta < w->last_time_delta) {
+    w->monotonic = 0;
+  }
+  w->last_time_delta = time_delta;
+  if(w->lines++ % w->every != 0) {
+    return 0;
+  }
+  
+  if(w->entry_count == w->entry_capacity) {
+    int capacity = w->entry_capacity ? w->entry_capacity * 2 : 1024;
+    time_index_entry_t *entries = (time_index_entry_t *)realloc(w->entries, capacity * sizeof(time_index_entry_t));
+    if(!entries) {
+      return -1;
+    }
+    w->entries = entries;
+    w->entry_capacity = capacity;
+  }
+  w->entries[w->entry_count].time_delta = time_delta;
+  w->entries[w->entry_count].offset = offset;
+  w->entry_count++;
+  
+  return 0;
+}
+
+int time_index_writer_anchor(time_index_writer_t *w, int64_t utc_ms, int64_t time_delta,
+                             uint64_t offset)
+{
+  if(w->anchor_count == w->anchor_capacity) {
+    int capacity = w->anchor_capacity ? w->anchor_capacity * 2 : 1024;
+    time_index_anchor_t *anchors = (time_index_anchor_t *)realloc(w->anchors, capacity * sizeof(time_index_anchor_t));
+    if(!anchors) {
+      return -1;
+    }
+    w->anchors = anchors;
+    w->anchor_capacity = capacity;
+  }
+  w->anchors[w->anchor_count].utc_ms = utc_ms;
+  w->anchors[w->anchor_count].time_delta = time_delta;
+  w->anchors[w->anchor_count].offset = offset;
+  w->anchor_count++;
+  
+  return 0;
+}
+
+int time_index_writer_save(time_index_writer_t *w, const char *filename, int input_fd,
+                           uint64_t input_length)
+{
+  time_index_header_t header;
+  checkpoint_id_t id;
+  struct stat st;
+  output_buffer_t *out;
+  int fd, rc;
+  
+  if(fstat(input_fd, &st) != 0 || checkpoint_identify(input_fd, &id) != 0) {
+    return -1;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TIME_INDEX_MAGIC, 4);
+  header.version = TIME_INDEX_VERSION;
+  header.input_length = input_length;
+  header.entry_count = w->entry_count;
+  header.anchor_count = w->anchor_count;
+  header.every = w->every;
+  header.monotonic = w->monotonic;
+  header.file_length = st.st_size;
+  header.head_length = id.head_length;
+  header.head_hash = id.head_hash;
+  
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    return -1;
+  }
+  out = output_buffer_create(TIME_INDEX_OUTPUT_LENGTH, fd);
+  if(!out) {
+    close(fd);
+    return -1;
+  }
+  rc = output_buffer_append(out, (char *)&header, sizeof(header));
+  if(rc == 0 && w->entry_count > 0) {
+    rc = output_buffer_append(out, (char *)w->entries, w->entry_count * sizeof(time_index_entry_t));
+  }
+  if(rc == 0 && w->anchor_count > 0) {
+    rc = output_buffer_append(out, (char *)w->anchors, w->anchor_count * sizeof(time_index_anchor_t));
+  }
+  if(rc == 0) {
+    rc = output_buffer_flush(out);
+  }
+  output_buffer_destroy(out);
+  if(close(fd) != 0) {
+    rc = -1;
+  }
+  
+  return rc;
+}
+
+time_index_t *time_index_open(const char *filename)
+{
+  time_index_t *index;
+  struct stat st;
+  uint64_t length;
+  int fd;
+  
+  fd = open(filename, O_RDONLY);
+  if(fd < 0) {
+    return NULL;
+  }
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(time_index_header_t)) {
+    close(fd);
+    return NULL;
+  }
+  
+  index = (time_index_t *)calloc(1, sizeof(time_index_t));
+  if(!index) {
+    close(fd);
+    return NULL;
+  }
+  index->length = st.st_size;
+  index->data = mmap(NULL, index->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(index->data == MAP_FAILED) {
+    free(index);
+    return NULL;
+  }
+  
+  index->header = (time_index_header_t *)index->data;
+  length = sizeof(time_index_header_t) +
+           (uint64_t)index->header->entry_count * sizeof(time_index_entry_t) +
+           (uint64_t)index->header->anchor_count * sizeof(time_index_anchor_t);
+  if(memcmp(index->header->magic, TIME_INDEX_MAGIC, 4) != 0 ||
+     index->header->version != TIME_INDEX_VERSION || length != index->length) {
+    time_index_close(index);
+    return NULL;
+  }
+  index->entries = (time_index_entry_t *)(index->data + sizeof(time_index_header_t));
+  index->anchors = (time_index_anchor_t *)(index->entries + index->header->entry_count);
+  
+  return index;
+}
+
+int time_index_check(time_index_t *index, int input_fd)
+{
+  checkpoint_id_t id;
+  struct stat st;
+  
+  // logs only grow, what was indexed is still there
+  if(fstat(input_fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+     (uint64_t)st.st_size < index->header->file_length) {
+    return -1;
+  }
+  id.head_length = index->header->head_length;
+  id.head_hash = index->header->head_hash;
+  
+  return checkpoint_same_head(input_fd, &id) ? 0 : -1;
+}
+
+void time_index_close(time_index_t *index)
+{
+  if(index) {
+    munmap(index->data, index->length);
+    free(index);
+  }
+}
+
+uint64_t time_index_find(time_index_t *index, int64_t time_delta)
+{
+  uint32_t lo = 0, hi, mid;
+  
+  // with a restart in the log a time_delta can be in several places,
+  // reading from the start finds the first
+  if(!index->header->monotonic || index->header->entry_count == 0 ||
+     index->entries[0].time_delta > time_delta) {
+    return 0;
+  }
+  
+  // last entry at or before time_delta
+  hi = index->header->entry_count;
+  while(hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if(index->entries[mid].time_delta <= time_delta) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  
+  // lines sharing a time_delta may start before the entry found
+  while(lo > 0 && index->entries[lo].time_delta == time_delta) {
+    lo--;
+  }
+  return index->entries[lo].offset;
+}
+
+int time_index_utc_to_time_delta(time_index_t *index, int64_t utc_ms, int64_t *time_delta)
+{
+  time_index_anchor_t *anchor = NULL;
+  uint32_t i;
+  
+  // anchors follow the log, which may have restarted, so no bisection
+  for(i = 0; i < index->header->anchor_count; i++) {
+    if(index->anchors[i].utc_ms <= utc_ms &&
+       (!anchor || index->anchors[i].utc_ms >= anchor->utc_ms)) {
+      anchor = &index->anchors[i];
+    }
+  }
+  if(!anchor) {
+    return -1;
+  }
+  *time_delta = anchor->time_delta + (utc_ms - anchor->utc_ms);
+  
+  return 0;
+}
+
+// days since 1970-01-01 of a proleptic gregorian date
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+  int64_t era;
+  int yoe, doy, doe;
+  
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = (int)(y - era * 400);
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  
+  return era * 146097 + doe - 719468;
+}
+
+int64_t time_index_utc_ms(int year, int month, int day, int hour, int minute, int second,
+                          int millisecond)
+{
+  int64_t seconds = days_from_civil(year, month, day) * 86400 +
+                    hour * 3600 + minute * 60 + second;
+  return seconds * 1000 + millisecond;
+}
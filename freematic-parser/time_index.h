@@ -0,0 +1,90 @@
+#ifndef _TIME_INDEX_H_
+#define _TIME_INDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Sidecar index of a raw log, all in host byte order:
+//   header   magic, version, counts
+//   entries  time_delta and offset of every Nth line, in file order
+//   anchors  gps clock (RMC date and time) against time_delta and offset
+#define TIME_INDEX_MAGIC    "FMTI"
+#define TIME_INDEX_VERSION  2
+#define TIME_INDEX_EVERY    1024
+
+typedef struct time_index_entry_str {
+  int64_t  time_delta;
+  uint64_t offset;
+} time_index_entry_t;
+
+typedef struct time_index_anchor_str {
+  int64_t  utc_ms;          // milliseconds since the epoch
+  int64_t  time_delta;
+  uint64_t offset;
+} time_index_anchor_t;
+
+typedef struct time_index_header_str {
+  char     magic[4];
+  uint32_t version;
+  uint64_t input_length;    // bytes of the log that were indexed
+  uint32_t entry_count;
+  uint32_t anchor_count;
+  uint32_t every;
+  uint32_t monotonic;       // 0 when time_delta went backwards, e.g. a logger restart
+  // the log file itself, as checkpoints identify it
+  uint64_t file_length;
+  uint64_t head_length;
+  uint64_t head_hash;
+} time_index_header_t;
+
+typedef struct time_index_writer_str {
+  time_index_entry_t  *entries;
+  int      entry_count;
+  int      entry_capacity;
+  time_index_anchor_t *anchors;
+  int      anchor_count;
+  int      anchor_capacity;
+  int      every;
+  long     lines;
+  int64_t  last_time_delta;
+  int      monotonic;
+} time_index_writer_t;
+
+typedef struct time_index_str {
+  char   *data;
+  size_t length;
+  time_index_header_t *header;
+  time_index_entry_t  *entries;
+  time_index_anchor_t *anchors;
+} time_index_t;
+
+time_index_writer_t *time_index_writer_create(int every);
+void time_index_writer_destroy(time_index_writer_t *w);
+
+// Called for every line in order, every Nth is kept.
+int time_index_writer_line(time_index_writer_t *w, int64_t time_delta, uint64_t offset);
+int time_index_writer_anchor(time_index_writer_t *w, int64_t utc_ms, int64_t time_delta,
+                             uint64_t offset);
+int time_index_writer_save(time_index_writer_t *w, const char *filename, int input_fd,
+                           uint64_t input_length);
+
+time_index_t *time_index_open(const char *filename);
+void time_index_close(time_index_t *index);
+
+// 0 when the index was built from the log on input_fd, or what it has
+// grown from since.  -1 for any other file, or one that can't be checked.
+int time_index_check(time_index_t *index, int input_fd);
+
+// Offset of the last indexed line at or before time_delta, reading on from
+// it reaches time_delta.  0 when the index can't narrow it down.
+uint64_t time_index_find(time_index_t *index, int64_t time_delta);
+
+// time_delta the log had at utc_ms, going by the nearest earlier anchor.
+// -1 when there is no anchor before utc_ms.
+int time_index_utc_to_time_delta(time_index_t *index, int64_t utc_ms, int64_t *time_delta);
+
+// Milliseconds since the epoch of a UTC civil date and time.
+int64_t time_index_utc_ms(int year, int month, int day, int hour, int minute, int second,
+                          int millisecond);
+
+#endif /* _TIME_INDEX_H_ */